@@ -0,0 +1,178 @@
+//  batch.cpp  -------------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+using std::string;
+
+namespace
+{
+
+//----------------------------------  work_queues  -------------------------------------//
+
+  //  One double-ended queue of item numbers per worker. A worker takes items from the
+  //  back of its own queue, and when that is empty steals from the front of the others.
+  //  Each worker starts with a contiguous block of items, so items that were listed
+  //  together, and so likely share includes, tend to be processed together.
+
+  class work_queues
+  {
+  public:
+    work_queues(std::size_t workers, std::size_t items)
+      : m_queues(workers)
+    {
+      for (std::size_t i = 0; i < items; ++i)
+        m_queues[i * workers / items].items.push_front(i);
+    }
+
+    bool pop(std::size_t worker, std::size_t& item)  // true if an item was found
+    {
+      {
+        queue& own(m_queues[worker]);
+        boost::lock_guard<boost::mutex> lock(own.mutex);
+        if (!own.items.empty())
+        {
+          item = own.items.back();
+          own.items.pop_back();
+          return true;
+        }
+      }
+
+      for (std::size_t i = 1; i < m_queues.size(); ++i)
+      {
+        queue& victim(m_queues[(worker + i) % m_queues.size()]);
+        boost::lock_guard<boost::mutex> lock(victim.mutex);
+        if (!victim.items.empty())
+        {
+          item = victim.items.front();
+          victim.items.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    struct queue
+    {
+      boost::mutex             mutex;
+      std::deque<std::size_t>  items;
+    };
+
+    std::vector<queue>  m_queues;
+  };
+
+//-------------------------------------  batch  ----------------------------------------//
+
+  class batch
+  {
+  public:
+    batch(const std::vector<mmp::batch_item>& items, const mmp::macro_map& definitions,
+      const mmp::processor::options& opts, std::size_t workers,
+      std::vector<mmp::dependencies>* deps)
+      : m_items(items), m_definitions(definitions), m_options(opts),
+        m_queues(workers, items.size()), m_deps(deps), m_error_count(0)
+    {
+      if (m_deps)
+        m_deps->assign(items.size(), mmp::dependencies());
+      if (!m_options.files)
+        m_options.files = boost::make_shared<mmp::file_cache>();
+    }
+
+    void work(std::size_t worker)
+    {
+      for (std::size_t item; m_queues.pop(worker, item);)
+        process(item);
+    }
+
+    int error_count() const { return m_error_count; }
+
+  private:
+    const std::vector<mmp::batch_item>&  m_items;
+    const mmp::macro_map&                m_definitions;
+    mmp::processor::options              m_options;
+    work_queues                          m_queues;
+    std::vector<mmp::dependencies>*      m_deps;  // each element written by one worker
+    boost::mutex                         m_log_mutex;  // guards *m_options.log
+    int                                  m_error_count;
+
+    void process(std::size_t i)
+    {
+      const mmp::batch_item& item(m_items[i]);
+      std::ostringstream log;
+      int error_count = 0;
+
+      mmp::output_file out(item.out_path);
+      mmp::processor::options opts(m_options);
+      opts.log = &log;
+      mmp::processor processor(opts);
+      processor.define(m_definitions);
+      processor.define(item.definitions);
+      error_count = processor.process(item.in_path, out.stream());
+      if (m_deps)
+        (*m_deps)[i] = processor.deps();
+      if (!out.commit())
+      {
+        log << item.in_path << ": error: could not write output file "
+            << item.out_path << '\n';
+        ++error_count;
+      }
+
+      boost::lock_guard<boost::mutex> lock(m_log_mutex);
+      if (m_options.verbose)
+        *m_options.log << item.in_path << " -> " << item.out_path
+                       << (out.changed() ? "\n" : " (unchanged)\n");
+      *m_options.log << log.str();
+      m_error_count += error_count;
+    }
+  };
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//---------------------------------  process_batch  ------------------------------------//
+
+  int process_batch(const std::vector<batch_item>& items,
+    const macro_map& definitions, const processor::options& opts, unsigned threads,
+    std::vector<dependencies>* deps)
+  {
+    if (deps)
+      deps->clear();
+    if (items.empty())
+      return 0;
+    if (threads == 0)
+      threads = boost::thread::hardware_concurrency();
+    if (threads == 0)
+      threads = 1;
+    if (threads > items.size())
+      threads = static_cast<unsigned>(items.size());
+
+    batch b(items, definitions, opts, threads, deps);
+
+    boost::thread_group pool;
+    for (unsigned i = 1; i < threads; ++i)
+      pool.create_thread([&b, i]() { b.work(i); });
+    b.work(0);  // the calling thread is worker 0
+    pool.join_all();
+
+    return b.error_count();
+  }
+
+}  // namespace mmp
@@ -0,0 +1,123 @@
+//  depfile.cpp  -----------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <ostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdlib>   // for getenv()
+#include <boost/cstdint.hpp>
+
+using std::string;
+
+namespace
+{
+
+//----------------------------------  fnv1a_hash  --------------------------------------//
+
+  const boost::uint64_t fnv_offset_basis = 14695981039346656037ULL;
+  const boost::uint64_t fnv_prime = 1099511628211ULL;
+
+  boost::uint64_t fnv1a_hash(const char* p, std::size_t n,
+    boost::uint64_t h = fnv_offset_basis)
+  {
+    for (; n; --n, ++p)
+    {
+      h ^= static_cast<unsigned char>(*p);
+      h *= fnv_prime;
+    }
+    return h;
+  }
+
+  void write_hash(std::ostream& os, boost::uint64_t h)
+  {
+    static const char digits[] = "0123456789abcdef";
+    char hex[16];
+    for (int i = 15; i >= 0; --i, h >>= 4)
+      hex[i] = digits[h & 0xf];
+    os.write(hex, 16);
+  }
+
+  bool hash_file(const string& path, boost::uint64_t& h)  // true if succeeds
+  {
+    std::ifstream in(path, std::ios_base::in|std::ios_base::binary);
+    if (!in)
+      return false;
+    h = fnv_offset_basis;
+    char buf[8192];
+    while (in.read(buf, sizeof(buf)) || in.gcount())
+      h = fnv1a_hash(buf, static_cast<std::size_t>(in.gcount()), h);
+    return !in.bad();
+  }
+
+//---------------------------------  write_escaped  ------------------------------------//
+
+  //  Escapes the characters of a path that Make and Ninja give a meaning to.
+
+  void write_escaped(std::ostream& os, const string& path)
+  {
+    for (string::const_iterator it = path.begin(); it != path.end(); ++it)
+    {
+      if (*it == ' ' || *it == '#' || *it == '\\')
+        os << '\\';
+      else if (*it == '$')
+        os << '$';
+      os << *it;
+    }
+  }
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//---------------------------------  write_depfile  ------------------------------------//
+
+  void write_depfile(std::ostream& os, const string& target, const dependencies& deps)
+  {
+    write_escaped(os, target);
+    os << ':';
+    for (std::set<string>::const_iterator it = deps.files.begin();
+      it != deps.files.end(); ++it)
+    {
+      os << " \\\n  ";
+      write_escaped(os, *it);
+    }
+    os << '\n';
+  }
+
+//---------------------------------  write_hashes  -------------------------------------//
+
+  void write_hashes(std::ostream& os, const dependencies& deps)
+  {
+    for (std::set<string>::const_iterator it = deps.files.begin();
+      it != deps.files.end(); ++it)
+    {
+      boost::uint64_t h;
+      if (hash_file(*it, h))
+        write_hash(os, h);
+      else
+        os << '-';
+      os << "  " << *it << '\n';
+    }
+
+    for (std::set<string>::const_iterator it = deps.environment.begin();
+      it != deps.environment.end(); ++it)
+    {
+      const char* value = std::getenv(it->c_str());
+      if (value)
+        write_hash(os, fnv1a_hash(value, std::strlen(value)));
+      else
+        os << '-';
+      os << "  $(" << *it << ")\n";
+    }
+  }
+
+}  // namespace mmp
@@ -7,323 +7,85 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#include "mmp.hpp"
 #include <boost/detail/lightweight_main.hpp>
-#include <boost/assert.hpp>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <string>
+#include <vector>
 #include <cstring>
-#include <cctype>
-#include <list>
-#include <stack>
-#include <map>
-#include <cstdlib>   // for getenv()
-#include <boost/lexical_cast.hpp>
+#include <cstdlib>
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
 
 using std::cout;
-using std::endl;
 using std::string;
-using std::memcmp;
-using boost::lexical_cast;
-
-/*
-   TODO List
-
-    *  Probable bug if file starts with macro. Add test case of file started by macro.
-    *  Throw on load_file() failure or each use check new_context() return.
-    *  Optimization, better error messages: Don't invoke macro_() for $def, etc.
-    *  Path, contents, of a file should be stored once and a shared_ptr should
-       be kept in the context state.
-    *  environmental variable reference not tested yet
-    *  See how QB associates markers with file types, and provides overrides of same.
-*/
+namespace fs = boost::filesystem;
 
 //--------------------------------------------------------------------------------------//
 
 namespace
 {
-  string          in_path;
-  string          out_path;
-  bool            verbose = false;
-  bool            log_input = false;
-  bool            log_output = false;
-
-  int             error_count = 0;
-
-  const string    default_command_start("$");
-  string          in_file_command_start("$");
-  const string    default_command_end(";");
-  const string    default_macro_start("$");
-  const string    default_macro_end(";");
-  const bool      no_macro_check = false;
-
-  std::ofstream   out;
-
-  struct context
-  {
-    string                  path;
-    int                     line_number;
-    string                  content;
-    string::const_iterator  cur;            // current position
-    string::const_iterator  end;            // past-the-end
-    string                  command_start;  // command start marker; !empty()
-    string                  command_end;    // command end marker; may be empty()
-    string                  macro_start_;   // !empty()
-    string                  macro_end_;     // !empty()
-    string                  snippet_id;     // may be empty()
-  };
-
-  typedef std::stack<context, std::list<context> > stack_type;
-  stack_type state;  // context stack
-
-  typedef std::map<string, string> macro_map;
-  macro_map macro;
-  
-  void text_(bool side_effects = true);
-  bool expression_();
-  string name_();
-  void macro_call_();
-  bool is_macro_start();
-  bool is_macro_end();
-
-//-------------------------------------  error  ----------------------------------------//
-
-  void error(const string& msg)
-  {
-    ++error_count;
-    if (state.empty() || !state.top().line_number)
-      cout << in_path << ": error: " << msg << endl;
-    else
-      cout << state.top().path << '(' << state.top().line_number
-           << "): error: " << msg << endl;
-  }
-
-//------------------------------------  advance  ---------------------------------------//
-
-  void advance(std::ptrdiff_t n=1, bool macro_check=true)
-  {
-    for(; n; --n)
-    {
-      if (*state.top().cur == '\n')
-        ++state.top().line_number;
-      ++state.top().cur;
-
-      while (state.top().cur == state.top().end && state.size() > 1)
-        state.pop();
-
-      if (log_input)
-      {
-        cout << "  Input: ";
-        if (state.top().cur == state.top().end)
-          cout << "end\n";
-        else
-          cout << *state.top().cur << "\n";
-      }
-
-      if (macro_check && state.top().cur != state.top().end && is_macro_start())
-      {
-        macro_call_();
-      }
-    }
-  }
-
-//---------------------------------  skip_whitespace  ----------------------------------//
-
-  inline void skip_whitespace()
-  {
-    for (; state.top().cur != state.top().end && std::isspace(*state.top().cur);
-      advance()) {}
-  }
-
-//--------------------------------  is_command_start  ----------------------------------//
-
- inline bool is_command_start()
- {
-   return std::memcmp(&*state.top().cur, state.top().command_start.c_str(),
-     state.top().command_start.size()) == 0;
- }
-//---------------------------------  is_command_end  -----------------------------------//
-
- inline bool is_command_end()
- {
-   return std::memcmp(&*state.top().cur, state.top().command_end.c_str(),
-     state.top().command_end.size()) == 0;
- }
-
- //----------------------------------  is_command  -------------------------------------//
-
- bool is_command(const char* x)
- {
-   if (!is_command_start())
-     return false;
-
-   string::const_iterator it(state.top().cur + state.top().command_start.size());
-
-   for (; it != state.top().end && std::isspace(*it); ++it) {}
-
-   string s;
-
-   for (; it != state.top().end && std::isalpha(*it); ++it)
-     s += *it;
-
-   return s == x;
- }
-
- //----------------------------------  skip_command  -----------------------------------//
-
- void skip_command()
- {
-   advance(state.top().command_start.size(), no_macro_check);
-   for (; state.top().cur != state.top().end && std::isspace(*state.top().cur);
-     advance(1, no_macro_check)) {}
-   for (; state.top().cur != state.top().end && std::isalpha(*state.top().cur);
-     advance(1, no_macro_check)) {}
- }
-
-//--------------------------------  is_macro_start  -----------------------------------//
-
- inline bool is_macro_start()
- {
-   return std::memcmp(&*state.top().cur, state.top().macro_start_.c_str(),
-     state.top().macro_start_.size()) == 0;
- }
-
-//---------------------------------  is_macro_end  ------------------------------------//
-
- inline bool is_macro_end()
- {
-   return std::memcmp(&*state.top().cur, state.top().macro_end_.c_str(),
-     state.top().macro_end_.size()) == 0;
- }
-
- //-----------------------------  advance_if_operator  ---------------------------------//
-                                                         
- bool advance_if_operator(const string& op)
- {
-   
-   const char* begin = &*state.top().cur;
-   const char* p(begin);
-   while (isspace(*p))
-     ++p;
-
-   if (memcmp(p, op.c_str(), op.size()) != 0)
-     return false;
-   advance((p-begin) + op.size());
-   return true;
- }
-
-//-----------------------------------  load_file  --------------------------------------//
-
-  bool load_file(const string& path, string& target)  // true if succeeds
-  {
-    std::ifstream in(path, std::ios_base::in|std::ios_base::binary );
-    if (!in)
-    {
-      error("could not open input file \"" + path + '"');
-      return false;
-    }
-    std::getline(in, target, '\0'); // read the whole file
-    return true;
-  }
-
-//----------------------------------  new_context  -------------------------------------//
-
-  bool new_context(const string& path,
-    const string& command_start = default_command_start,
-    const string& command_end = default_command_end,
-    const string& macro_start = default_macro_start,
-    const string& macro_end = default_macro_end
-    )  // true if succeeds
-  {
-    state.push(context());
-    state.top().path = path;
-    state.top().line_number = 0;
-    if (!load_file(path, state.top().content))
-    {
-      state.pop();
-      return false;
-    }
-    ++state.top().line_number;
-    state.top().cur = state.top().content.cbegin();
-    state.top().end = state.top().content.cend();
-    state.top().command_start = command_start;
-    state.top().command_end = command_end;
-    state.top().macro_start_ = macro_start;
-    state.top().macro_end_ = macro_end;
-    return true;
-  }
-
-//--------------------------------  push_content  --------------------------------------//
-
-  void push_content(const string& name, const string& content)
-  {
-    if (verbose)
-      cout << "pushing " << name << " with content \"" << content << '"' <<endl;
-
-    context cx;
-
-    cx.path = name;
-    cx.line_number = 1;
-    cx.content = content;
-    cx.command_start = state.top().command_start; 
-    cx.command_end = state.top().command_end; 
-    cx.macro_start_ = state.top().macro_start_; 
-    cx.macro_end_ = state.top().macro_end_;
-
-    state.push(cx);
-    state.top().cur = state.top().content.cbegin();
-    state.top().end = state.top().content.cend();
-  }
-
-//-----------------------------------  set_id  -----------------------------------------//
-
-  void set_id(const string& id)
-  {
-    BOOST_ASSERT(state.top().cur == state.top().content.cbegin()); // precondition check
-    state.top().snippet_id = id;
-
-    // find the start of the id command
-    string command(state.top().command_start + "id " + id + "=");
-    string::size_type pos = state.top().content.find(command);
-    if (pos == string::npos)
-    {
-      error("Could not find snippet " + id + " in " + state.top().path);
-      state.top().cur = state.top().end;
-      return;
-    }
-
-    // set cur to start of snippet
-    advance(pos + command.size(), no_macro_check);
-
-    // find the end of the snippet
-    pos = state.top().content.find(state.top().command_start+"endid", pos);
-    if (pos == string::npos)
-    {
-      error("Could not find " + state.top().command_start + "endid for snippet "
-        + id + " in " + state.top().path);
-      state.top().cur = state.top().end;
-      return;
-    }
-    state.top().end = state.top().content.cbegin() + pos;
-  }
+  string                    in_path;
+  string                    out_path;
+  mmp::processor::options   options;
+  mmp::macro_map            definitions;  // from the command line
+  string                    manifest_path;
+  string                    configs_path;
+  string                    depfile_path;
+  string                    hashes_path;
+  string                    trace_path;
+  string                    cache_path;
+  string                    profiles_path;
+  string                    serve_path;
+  string                    client_path;
+  bool                      tree = false;
+  bool                      watching = false;
+  unsigned                  jobs = 0;
 
 //------------------------------------  setup  -----------------------------------------//
 
   bool setup(int argc, char* argv[])  // true if succeeds
   {
     bool ok = true;
-    while (argc > 3) 
+
+    // a manifest replaces the input-path and output-path arguments, and a
+    // configurations file replaces the output-path argument
+    int paths = 2;
+    for (int i = 1; i < argc; ++i)
+      if (std::strncmp(argv[i], "-batch=", 7) == 0
+        || std::strncmp(argv[i], "-serve=", 7) == 0)
+        paths = 0;
+      else if (std::strncmp(argv[i], "-configs=", 9) == 0 && paths)
+        paths = 1;
+
+    while (argc > paths + 1) 
     {
-      if (std::strchr(argv[1], '='))
+      if (std::strncmp(argv[1], "-batch=", 7) == 0) manifest_path = argv[1] + 7;
+      else if (std::strncmp(argv[1], "-configs=", 9) == 0) configs_path = argv[1] + 9;
+      else if (std::strncmp(argv[1], "-jobs=", 6) == 0) jobs = std::atoi(argv[1] + 6);
+      else if (std::strncmp(argv[1], "-depfile=", 9) == 0) depfile_path = argv[1] + 9;
+      else if (std::strncmp(argv[1], "-hashes=", 8) == 0) hashes_path = argv[1] + 8;
+      else if (std::strncmp(argv[1], "-trace=", 7) == 0) trace_path = argv[1] + 7;
+      else if (std::strncmp(argv[1], "-cache=", 7) == 0) cache_path = argv[1] + 7;
+      else if (std::strncmp(argv[1], "-profiles=", 10) == 0)
+        profiles_path = argv[1] + 10;
+      else if (std::strncmp(argv[1], "-serve=", 7) == 0) serve_path = argv[1] + 7;
+      else if (std::strncmp(argv[1], "-client=", 8) == 0) client_path = argv[1] + 8;
+      else if (std::strchr(argv[1], '='))
       {
         string name(argv[1], std::strchr(argv[1], '='));
         string value(std::strchr(argv[1], '=')+1, argv[1]+std::strlen(argv[1]));
-        macro[name] = value;
+        definitions[name] = value;
       }
-      else if ( std::strcmp( argv[1], "-verbose" ) == 0 ) verbose = true;
-      else if ( std::strcmp( argv[1], "-log-input" ) == 0 ) log_input = true;
-      else if ( std::strcmp( argv[1], "-log-output" ) == 0 ) log_output = true;
+      else if ( std::strcmp( argv[1], "-verbose" ) == 0 ) options.verbose = true;
+      else if ( std::strcmp( argv[1], "-log-input" ) == 0 ) options.log_input = true;
+      else if ( std::strcmp( argv[1], "-log-output" ) == 0 ) options.log_output = true;
+      else if ( std::strcmp( argv[1], "-tree" ) == 0 ) tree = true;
+      else if ( std::strcmp( argv[1], "-watch" ) == 0 ) watching = true;
+      else if ( std::strcmp( argv[1], "-interpret" ) == 0 ) options.compile = false;
+      else if ( std::strcmp( argv[1], "-stream" ) == 0 ) options.stream = true;
+      else if ( std::strcmp( argv[1], "-stats" ) == 0 ) options.stats = true;
       else
       { 
         cout << "Error: unknown option: " << argv[1] << "\n"; ok = false;
@@ -332,10 +94,21 @@ namespace
       ++argv;
     }
 
-    if (argc == 3)
+    if (!trace_path.empty() && serve_path.empty())  // a server's trace is never written
+      options.trace = boost::make_shared<mmp::trace_log>();
+
+    if (!cache_path.empty())
+    {
+      options.files = boost::make_shared<mmp::file_cache>();
+      options.files->persist(fs::absolute(cache_path).string());
+    }
+
+    if (argc == paths + 1)
     {
-      in_path = argv[1];
-      out_path = argv[2];
+      if (paths)
+        in_path = argv[1];
+      if (paths == 2)
+        out_path = argv[2];
     }
     else
     {
@@ -347,462 +120,309 @@ namespace
     {
       cout <<
         "Usage: mmp [option...] input-path output-path\n"
+        "       mmp [option...] -tree input-directory output-directory\n"
+        "       mmp [option...] -batch=manifest-path\n"
+        "       mmp [option...] -configs=configurations-path input-path\n"
+        "       mmp [option...] -serve=socket-path\n"
         "  option: name=value   Define macro\n"
         "          -verbose     Report progress during processing\n"
+        "          -jobs=n      Process a tree, batch, or configurations on n threads;\n"
+        "                       default is one per hardware thread\n"
+        "          -interpret   Parse the text on every use, instead of compiling\n"
+        "                       inputs that are reused, as by -configs, -watch,\n"
+        "                       -cache, or a server\n"
+        "          -stream      Process a very large input in bounded memory, if\n"
+        "                       it can be memory-mapped on a POSIX system\n"
+        "          -stats       Report times, sizes, and counts for each input\n"
+        "          -trace=path  Write a Chrome trace of the files, snippets, and\n"
+        "                       macro calls processed\n"
+        "          -profiles=path\n"
+        "                       Use the markers given in path for files with\n"
+        "                       the extensions given there\n"
+        "          -cache=directory\n"
+        "                       Keep snippet indexes and compiled templates in\n"
+        "                       directory, for reuse by later runs\n"
+        "          -depfile=path\n"
+        "                       Write a Make/Ninja depfile listing the files read\n"
+        "                       for each output\n"
+        "          -hashes=path Write a content hash of each file and environment\n"
+        "                       variable read\n"
+        "          -watch       Keep running, and process again the outputs that\n"
+        "                       read a file whenever it changes\n"
+        "          -client=socket-path\n"
+        "                       Have the server at socket-path process the input,\n"
+        "                       or process it here if the server can't be reached\n"
+        "  A manifest has one \"input-path output-path\" pair per line. Paths with\n"
+        "  spaces are enclosed in double quotes. Blank lines and lines beginning with\n"
+        "  # are ignored.\n"
+        "  A configurations file has one \"output-path [name=value...]\" line per\n"
+        "  output, each rendering the input with those macros also defined. Quoting\n"
+        "  and comments are as for a manifest.\n"
+        "  A profiles file has one \"extension command-start command-end macro-start\n"
+        "  macro-end\" line per file type, e.g. \".html <!--$ --> $ ;\". Quoting and\n"
+        "  comments are as for a manifest, \"\" is an empty command-end, and \\n is a\n"
+        "  newline.\n"
         "Example: mmp -verbose VERSION=1.5 \"DESC=Beta 1\" index.html ..index.html\n"
         ;
     }
     return ok;
   }
 
-//--------------------------------------------------------------------------------------//
-//                                                                                      //
-//                                   EBNF Grammars                                      //
-//                                                                                      //
-//  Notation: ::= for production rules, | for alternatives, {...} for zero or more,     //
-//  [...] for optional                                                                  //
-//                                                                                      //
-//--------------------------------------------------------------------------------------//
-
-/*
-
-  --------------------------------------------------------------------------------------
-
-  //  no whitespace permitted between elements
-
-  macro-call    ::= macro-start macro-body
- 
-  macro-body    ::= macro-end                      // null macro, pushes macro-start
-                  | "(" macro-name ")"  macro-end  // pushes value of macro-name
-                                                   // environmental variable if found,
-                                                   // otherwise pushes macro-call
-                  | macro-name  [macro-end]        // if no macro-end, pushes macro-call
-                                                   // if macro-name defined, pushes
-                                                   // what it is defined as,
-                                                   // otherwise pushes macro-call
-
-  macro-start   ::= "$"                            // replaceable; see docs
-                  
-  macro-end     ::= ";"                            // replaceable; see docs
-
-  macro_name    ::= name_char {name_char}
-  //  In certain file contexts, a command-start is only recognized inside a comment,
-  //  where the comment syntax is specific for that file type.
-
-  --------------------------------------------------------------------------------------
-
-  text          ::= { command-start command command-end
-                    | character
-                    }
-    
-  //  whitespace permitted between elements unless otherwise specified
-
-  command       ::= "def" name string          // name shall not be a keyword
-                  | "include" string           // string is filename
-                  | "snippet" name string      // name is id, string is filename
-                  | "if" if_body
-
-  command-end   ::= ";"                     // replaceable; see docs
-                  | whitespace {whitespace}
-
-  if_body       ::= expression text
-                    {command-start "elif" expression text}
-                    [command-start "else" text]
-                    command-start "endif"
-
-  command-start ::= "$"                         // replaceable; see docs
-
-  string        ::= name
-                  | """{s-char}"""
-
-  s-char        ::= "\"" | "\r" | "\n"
-                  | character                   // " not allowed
-
-  name          ::= name-char{name-char}
-
-  name-char     ::= alnum-char | "_"
-
-  primary_expr  ::= string "==" string
-                  | string "!=" string
-                  | string "<"   string
-                  | string "<=" string
-                  | string ">" string
-                  | string ">=" string
-                  | "(" expression ")"
-  
-  and-expr      ::= primary_expr {"&&" primary_expr}
-                         
-  expression    ::= and-expr {"||" and-expr}
-
-  --------------------------------------------------------------------------------------
-
-  //  snippet grammar
-
-  $id snippet=
-
-  //  whitespace permitted only in {character}
-
-  snippet    ::= command_start "id " name "=" {character} command-start "endid" $endid
-
-*/
-
-//--------------------------------------------------------------------------------------//
-//                                                                                      //
-//                           Recursive Decent Parsers                                   //
-//     functions with names ending in underscore correspond to grammar productions      //
-//                                                                                      //
-//--------------------------------------------------------------------------------------//
-
-//--------------------------------------------------------------------------------------//
-//                                 macro-call parser                                    //
-//--------------------------------------------------------------------------------------//
-
-string macro_name();
-
-//-----------------------------------  macro_call  -------------------------------------//
-
-void macro_call_()
-{
-  advance(state.top().macro_start_.size(), no_macro_check);
+//-------------------------------------  path_  ----------------------------------------//
 
-  // null macro
-  if (is_macro_end())
-  {
-    advance(state.top().macro_end_.size(), no_macro_check);
-    push_content("null macro", state.top().macro_start_);
-  }
+  //  Extracts the next, possibly quoted, path from a manifest line; empty if none.
 
-  // enviromental variable reference
-  else if (state.top().cur != state.top().end && *state.top().cur == '(')
+  string path_(const string& line, string::size_type& pos)
   {
-    advance(1, no_macro_check);
-    string name(macro_name());
-    const char* p = std::getenv(name.c_str());
-    if (state.top().cur != state.top().end && *state.top().cur == ')')
-      advance(1, no_macro_check);
-    else
-      error("missing closing )");
-    if (is_macro_end())
-      advance(state.top().macro_end_.size(), no_macro_check);
-    else
-      error("missing " + state.top().macro_end_);
+    pos = line.find_first_not_of(" \t\r", pos);
+    if (pos == string::npos)
+      return string();
 
-    if (p)
-      push_content(state.top().macro_start_+"("+ name +")"+state.top().macro_end_, p);
-    else
+    string::size_type end;
+    string path;
+    if (line[pos] == '"')
     {
-      error("not found: " + state.top().macro_start_
-        + "(" + name + ")" + state.top().macro_end_);
-      push_content(state.top().macro_start_
-        + "(" + name + ")" + state.top().macro_end_, state.top().macro_start_
-        + "(" + name + ")" + state.top().macro_end_);
+      end = line.find('"', ++pos);
+      path = line.substr(pos, end == string::npos ? end : end - pos);
+      pos = end == string::npos ? end : end + 1;
     }
-  }
-
-  // macro-name [macro-end]
-  else
-  {
-    string name(macro_name());
-    if (is_macro_end())
+    else
     {
-      advance(state.top().macro_end_.size(), no_macro_check);
-      macro_map::const_iterator it(macro.find(name));
-      if (it != macro.cend())  // macro found
-        push_content(state.top().macro_start_ + name + state.top().macro_end_,
-          it->second);
-      else  // macro not found so push advanced over characters
-        push_content(state.top().macro_start_ + name + state.top().macro_end_,
-          state.top().macro_start_ + name + state.top().macro_end_);
+      end = line.find_first_of(" \t\r", pos);
+      path = line.substr(pos, end == string::npos ? end : end - pos);
+      pos = end;
     }
-    else  // no macro-end so push advanced over characters
-      push_content(state.top().macro_start_ + name, state.top().macro_start_ + name);
+    return path;
   }
-}
 
-//------------------------------------  macro_name  ------------------------------------//
+//--------------------------------  load_profiles  -------------------------------------//
 
-string macro_name()
-{
-  string name;
+  //  Reads the marker profiles into options.profiles. In a marker, \n is a newline,
+  //  \t a tab, and \\ a backslash.
 
-  while (state.top().cur != state.top().end
-    && (std::isalnum(*state.top().cur) || *state.top().cur == '_'))
+  bool load_profiles()  // true if succeeds
   {
-    name += *state.top().cur;
-    advance();
-  }
-
-  return name;
-}
-
-//--------------------------------------------------------------------------------------//
-//                                    text parser                                       //
-//--------------------------------------------------------------------------------------//
-
-//-------------------------------------  name_  ----------------------------------------//
-
-  string name_()
-  {
-    skip_whitespace(); 
-
-    string s;
-
-    // store string
-    for (; state.top().cur != state.top().end &&
-      (std::isalnum(*state.top().cur) || *state.top().cur == '_');
-      advance())
+    std::ifstream in(profiles_path);
+    if (!in)
     {
-      s += *state.top().cur;
+      cout << "Error: could not open profiles " << profiles_path << '\n';
+      return false;
     }
 
-    return s;
-  }
-
-//---------------------------------  simple_string_  -----------------------------------//
-
-  inline string simple_string_()
-  {
-    return name_();
-  }
-
-//-----------------------------------  string_  ----------------------------------------//
-
-  string string_()
-  {
-    skip_whitespace(); 
-
-    if (*state.top().cur != '"')
-      return simple_string_();
-
-    int starting_line = state.top().line_number;
-
-    advance();  // bypass the '"'
-
-    string s;
-
-    // store string
-    for (; state.top().cur != state.top().end && *state.top().cur != '"'; advance())
+    bool ok = true;
+    string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number)
     {
-      s += *state.top().cur;
-    }
+      string::size_type pos = line.find_first_not_of(" \t\r");
+      if (pos == string::npos || line[pos] == '#')
+        continue;
 
-    // maintain the state.top().cur invariant
-    if (*state.top().cur == '"')
-      advance();
-    else
-    {
-      error("no closing quote for string that began on line "
-        + lexical_cast<string>(starting_line));
-    }
+      string fields[5];  // extension, then the markers
+      int n = 0;
+      for (; n < 5 && pos != string::npos; ++n)
+      {
+        fields[n] = path_(line, pos);
+        if (fields[n].empty() && pos == string::npos)  // nothing more on the line
+          break;
+        for (string::size_type i = 0; (i = fields[n].find('\\', i)) != string::npos
+          && i + 1 < fields[n].size(); ++i)
+        {
+          char c = fields[n][i + 1];
+          fields[n].replace(i, 2, 1, c == 'n' ? '\n' : c == 't' ? '\t' : c);
+        }
+      }
 
-    return s;
+      if (n < 5 || fields[0].size() < 2 || fields[0][0] != '.' || fields[1].empty()
+        || fields[3].empty() || fields[4].empty()
+        || (pos != string::npos && line.find_first_not_of(" \t\r", pos) != string::npos))
+      {
+        cout << profiles_path << '(' << line_number << "): error: expected \""
+             << "extension command-start command-end macro-start macro-end\"\n";
+        ok = false;
+        continue;
+      }
+      mmp::marker_profile& profile(options.profiles[fields[0]]);
+      profile.command_start = fields[1];
+      profile.command_end = fields[2];
+      profile.macro_start = fields[3];
+      profile.macro_end = fields[4];
+    }
+    return ok;
   }
 
-//----------------------------------  primary_expr_  -----------------------------------//
+//---------------------------------  load_manifest  ------------------------------------//
 
-  bool primary_expr_()  // true if evaluates to true
+  bool load_manifest(std::vector<mmp::batch_item>& items)  // true if succeeds
   {
-    
-    if (advance_if_operator("("))
+    std::ifstream in(manifest_path);
+    if (!in)
     {
-      bool expr = expression_();
-      skip_whitespace();
-      if (*state.top().cur == ')')
-        advance();
-      else
-        error("syntax error: expected ')' to close expression");
-      return expr;
+      cout << "Error: could not open manifest " << manifest_path << '\n';
+      return false;
     }
 
-    string lhs(string_());
-    skip_whitespace();
-    string operation;
-    if (std::strchr("=!<>", *state.top().cur))
-    {
-      operation += *state.top().cur;
-      advance();
-    }
-    if (*state.top().cur == '=')
+    bool ok = true;
+    string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number)
     {
-      operation += '=';
-      advance();
+      string::size_type pos = line.find_first_not_of(" \t\r");
+      if (pos == string::npos || line[pos] == '#')
+        continue;
+
+      mmp::batch_item item;
+      item.in_path = path_(line, pos);
+      if (pos != string::npos)
+        item.out_path = path_(line, pos);
+      if (item.out_path.empty()
+        || (pos != string::npos && line.find_first_not_of(" \t\r", pos) != string::npos))
+      {
+        cout << manifest_path << '(' << line_number
+             << "): error: expected \"input-path output-path\"\n";
+        ok = false;
+      }
+      else
+        items.push_back(item);
     }
-
-    string rhs(string_());
-
-    if (operation == "==")
-      return lhs == rhs;
-    else if (operation == "!=")
-      return lhs != rhs;
-    else if (operation == "<")
-      return lhs < rhs;
-    else if (operation == "<=")
-      return lhs <= rhs;
-    else if (operation == ">")
-      return lhs > rhs;
-    else if (operation == ">=")
-      return lhs >= rhs;
-    else
-      error("expected a relational operator instead of \"" + operation + "\"");
-    return false;
+    return ok;
   }
 
-//-----------------------------------  and_expr_  --------------------------------------//
+//----------------------------------  load_configs  ------------------------------------//
+
+  //  Adds one item per configuration, each rendering in_path with its own definitions.
 
-  bool and_expr_()  // true if evaluates to true
+  bool load_configs(std::vector<mmp::batch_item>& items)  // true if succeeds
   {
-    bool result = primary_expr_();
-  
-    for (; advance_if_operator("&&");)
+    std::ifstream in(configs_path);
+    if (!in)
     {
-      if (!primary_expr_())
-        result = false;     
+      cout << "Error: could not open configurations " << configs_path << '\n';
+      return false;
     }
-    return result;
-  }
-
-//----------------------------------  expression_  -------------------------------------//
 
-  bool expression_()  // true if evaluates to true
-  {
-    bool result = and_expr_();
-  
-    for (; advance_if_operator("||");)
+    bool ok = true;
+    string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number)
     {
-      if (and_expr_())
-        result = true;     
+      string::size_type pos = line.find_first_not_of(" \t\r");
+      if (pos == string::npos || line[pos] == '#')
+        continue;
+
+      mmp::batch_item item;
+      item.in_path = in_path;
+      item.out_path = path_(line, pos);
+      while (pos != string::npos)
+      {
+        string definition(path_(line, pos));
+        string::size_type eq = definition.find('=');
+        if (eq == string::npos || eq == 0)
+        {
+          if (!definition.empty())
+          {
+            cout << configs_path << '(' << line_number
+                 << "): error: expected name=value, found " << definition << '\n';
+            ok = false;
+          }
+          continue;
+        }
+        item.definitions[definition.substr(0, eq)] = definition.substr(eq + 1);
+      }
+      items.push_back(item);
     }
-    return result;
+    return ok;
   }
 
-//-----------------------------------  if_body_  ---------------------------------------//
+//------------------------------------  load_tree  -------------------------------------//
 
-  void if_body_(bool side_effects)
-  {
-    int if_line_n = state.top().line_number;
+  //  Adds every file in the in_path directory tree, to be processed into the same
+  //  relative path in the out_path tree, whose directories are created as needed.
 
-    // expression text
-    bool true_done = expression_();
-    text_(true_done && side_effects);
-
-    // {command-start "elif" command-end expression text}
-    while (is_command("elif"))
-    {
-      skip_command();
-      text_((!true_done && (true_done = expression_())) && side_effects);
-    }
-
-    // [command-start "else" command-end text]
-    if (is_command("else"))
+  bool load_tree(std::vector<mmp::batch_item>& items)  // true if succeeds
+  {
+    try
     {
-      skip_command();
-      text_(!true_done && side_effects);
+      fs::path in_dir(in_path), out_dir(out_path);
+      for (fs::recursive_directory_iterator it(in_dir), end; it != end; ++it)
+      {
+        if (!fs::is_regular_file(it->status()))
+          continue;
+        fs::path target(out_dir / fs::relative(it->path(), in_dir));
+        fs::create_directories(target.parent_path());
+
+        mmp::batch_item item;
+        item.in_path = it->path().string();
+        item.out_path = target.string();
+        items.push_back(item);
+      }
     }
-
-    // command-start "endif"
-    if (is_command("endif"))
+    catch (const fs::filesystem_error& ex)
     {
-       advance(state.top().command_start.size(), no_macro_check);
-       advance(sizeof("endif")-1, no_macro_check);
+      cout << "Error: " << ex.what() << '\n';
+      return false;
     }
-    else
-      error("expected \"endif\" to close \"if\" begun on line "
-        + lexical_cast<string>(if_line_n));
+    return true;
   }
 
-//-----------------------------------  command_  ---------------------------------------//
+//---------------------------------  write_deps  --------------------------------------//
 
-  void command_(bool side_effects) 
-  {
-    advance(state.top().command_start.size(), no_macro_check);
-    string command(name_());
-
-    // def[ine] macro command
-    if (command == "def")
-    {
-      string name(name_());
-      string value(string_());
-      if (side_effects)
-        macro[name] = value;
-    }
+  //  Writes the depfile and hashes, if requested, for items[i] depending on deps[i],
+  //  and the trace, if requested.
 
-    // include command
-    else if (command == "include")
+  bool write_deps(const std::vector<mmp::batch_item>& items,
+    const std::vector<mmp::dependencies>& deps)  // true if succeeds
+  {
+    bool ok = true;
+    if (!depfile_path.empty())
     {
-      string path(string_());
-      if (side_effects)
+      std::ofstream os(depfile_path, std::ios_base::out|std::ios_base::binary);
+      for (std::size_t i = 0; i < items.size(); ++i)
+        mmp::write_depfile(os, items[i].out_path, deps[i]);
+      if (!os)
       {
-        new_context(path);
-        text_();
+        cout << "Error: could not write depfile " << depfile_path << '\n';
+        ok = false;
       }
     }
 
-    // snippet command
-    else if (command == "snippet")
+    if (!hashes_path.empty())
     {
-      string id(name_());
-      string path(string_());
-      if (side_effects)
+      mmp::dependencies all;
+      for (std::size_t i = 0; i < deps.size(); ++i)
+      {
+        all.files.insert(deps[i].files.begin(), deps[i].files.end());
+        all.environment.insert(deps[i].environment.begin(), deps[i].environment.end());
+      }
+      std::ofstream os(hashes_path, std::ios_base::out|std::ios_base::binary);
+      mmp::write_hashes(os, all);
+      if (!os)
       {
-        new_context(path);
-        set_id(id);
-        text_();
+        cout << "Error: could not write hashes " << hashes_path << '\n';
+        ok = false;
       }
     }
 
-    // if command
-    else if (command == "if")
-      if_body_(side_effects);
-
-    // not a command
-    else
-      error(command + " is not a valid command");
-  }
-
-//------------------------------------- text_  -----------------------------------------//
-
-  void text_(bool side_effects)
-  {
-    BOOST_ASSERT(!state.empty());  // failure indicates program logic error
-
-    //if (verbose)
-    //  cout << "Processing " << state.top().path << "...\n";
-
-    for(; state.top().cur != state.top().end;)
+    if (options.trace)
     {
-      if (is_command_start())
-      { 
-        // text_ is terminated by an elif, else, or endif
-        if (is_command("elif")
-          || is_command("else")
-          || is_command("endif"))
-          return;
-
-        command_(side_effects);
-        if (state.top().cur == state.top().end)
-          break;
-        if (is_command_end())
-          advance(state.top().command_end.size(), false);
-        else
-          skip_whitespace();
-     }
-      else  // character
+      std::ofstream os(trace_path, std::ios_base::out|std::ios_base::binary);
+      options.trace->write(os);
+      if (!os)
       {
-        if (side_effects)
-        {
-          out << *state.top().cur;;
-
-          if (log_output)
-            cout << "  Output: " << *state.top().cur << endl;
-        }
-        advance();
+        cout << "Error: could not write trace " << trace_path << '\n';
+        ok = false;
       }
     }
+    return ok;
+  }
+
+//-----------------------------------  rendered  ---------------------------------------//
 
-    //if (verbose)
-    //  cout << "  " << state.top().path << " complete\n";
+  //  Reports each round of -watch.
 
-    BOOST_ASSERT(state.size() == 1);  // failure indicates program logic error
+  void rendered(const std::vector<mmp::batch_item>& items,
+    const std::vector<mmp::dependencies>& deps, int error_count)
+  {
+    if (!write_deps(items, deps))
+      ++error_count;
+    cout << error_count << " error(s) detected" << std::endl;
   }
 
 }  // unnamed namespace
@@ -815,32 +435,74 @@ string macro_name()
 
 int cpp_main(int argc, char* argv[])
 {
-  if (!setup(argc, argv))
+  if (!setup(argc, argv) || (!profiles_path.empty() && !load_profiles()))
     return 1;
 
-  out.open(out_path, std::ios_base::out|std::ios_base::binary);
-  if (!out)
-  {
-    error("could not open output file " + out_path);
-    goto done;
-  }
+  if (!serve_path.empty())  // returns only if serving fails
+    return mmp::serve(serve_path, definitions, options);
 
-  if (!new_context(in_path, in_file_command_start))
-    goto done;
+  int error_count = 0;
+  bool batch = !manifest_path.empty() || !configs_path.empty() || tree;
 
-  text_();
+  // the server does plain runs only, and a trace is of the run in this process
+  if (!client_path.empty() && !batch && !watching && !options.trace)
+  {
+    std::vector<mmp::dependencies> deps(1);
+    error_count = mmp::request(client_path, in_path, out_path, definitions, options,
+      &deps[0]);
+    if (error_count >= 0)
+    {
+      std::vector<mmp::batch_item> items(1);
+      items[0].out_path = out_path;
+      if (!write_deps(items, deps))
+        ++error_count;
+      cout << error_count << " error(s) detected\n";
+      return error_count ? 1 :0;
+    }
+    if (options.verbose)
+      cout << "could not reach server at " << client_path << "; processing here\n";
+    error_count = 0;
+  }
 
-  if (verbose)
+  if (batch || watching)
   {
-    cout << "Dump macro definitions:\n";
-    for (macro_map::const_iterator it = macro.cbegin();
-      it != macro.cend(); ++it)
+    std::vector<mmp::batch_item> items;
+    if (!batch)
     {
-      cout << "  " << it->first << ": \"" << it->second << "\"\n";
+      items.push_back(mmp::batch_item());
+      items.back().in_path = in_path;
+      items.back().out_path = out_path;
     }
+    else if (!(!manifest_path.empty() ? load_manifest(items)
+      : !configs_path.empty() ? load_configs(items) : load_tree(items)))
+      return 1;
+
+    if (watching)  // returns only if watching fails
+      return mmp::watch(items, definitions, options, jobs, rendered) ? 1 : 0;
+
+    std::vector<mmp::dependencies> deps;
+    error_count = mmp::process_batch(items, definitions, options, jobs, &deps);
+    if (!write_deps(items, deps))
+      ++error_count;
+    cout << error_count << " error(s) detected\n";
+    return error_count ? 1 :0;
   }
 
-done:
+  mmp::output_file out(out_path);
+  mmp::processor processor(options);
+  processor.define(definitions);
+  error_count = processor.process(in_path, out.stream());
+  if (!out.commit())
+  {
+    cout << in_path << ": error: could not write output file " << out_path << '\n';
+    ++error_count;
+  }
+  else if (options.verbose && !out.changed())
+    cout << out_path << " is unchanged\n";
+  std::vector<mmp::batch_item> items(1);
+  items[0].out_path = out_path;
+  if (!write_deps(items, std::vector<mmp::dependencies>(1, processor.deps())))
+    ++error_count;
 
   cout << error_count << " error(s) detected\n";
 
@@ -0,0 +1,328 @@
+//  mmp.hpp  ---------------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#ifndef MMP_HPP
+#define MMP_HPP
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <iosfwd>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace mmp
+{
+  typedef std::map<std::string, std::string> macro_map;
+
+  //  What the output of a run depends on besides the macro definitions given to it.
+
+  struct dependencies
+  {
+    std::set<std::string>  files;        // input, include, and snippet files read
+    std::set<std::string>  environment;  // names of the environment variables read,
+                                         // whether or not they were set
+  };
+
+  //  The markers used in files of one type. A file is processed with the profile for
+  //  its extension, if there is one, and otherwise with the default markers, $ and ;.
+
+  struct marker_profile
+  {
+    std::string  command_start;  // !empty()
+    std::string  command_end;    // may be empty()
+    std::string  macro_start;    // !empty()
+    std::string  macro_end;      // !empty()
+  };
+
+  //  The key is the extension, with its dot; e.g. ".html".
+  typedef std::map<std::string, marker_profile> marker_profile_map;
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                  class file_cache                                    //
+//                                                                                      //
+//  The contents of input files, each loaded once and kept for the life of the cache.   //
+//  A cache may be shared by several processors, including processors running           //
+//  concurrently; files are assumed not to change while the cache exists, unless they   //
+//  are forgotten.                                                                      //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  class file_cache
+  {
+  public:
+    file_cache();
+    ~file_cache();
+
+    //  Drops the file at path, if loaded, so it is loaded again the next time it is
+    //  used. Processors that are using the file keep the contents they have.
+    void forget(const std::string& path);
+
+    //  Drops every file whose time or size has changed since it was loaded.
+    void forget_changed();
+
+    //  Keeps the snippet indexes and compiled templates of files in directory, created
+    //  if need be, so that later runs, and other caches using the same directory, can
+    //  reuse them instead of scanning and compiling the files again. A file's entry is
+    //  used only if the file's path, size, time, and contents are unchanged.
+    void persist(const std::string& directory);
+
+  private:
+    friend class processor;
+    class impl;
+    boost::scoped_ptr<impl> m_impl;
+
+    file_cache(const file_cache&);           // noncopyable
+    file_cache& operator=(const file_cache&);
+  };
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                   class trace_log                                    //
+//                                                                                      //
+//  Timed events for the files, snippets, and macro calls processed, collected from     //
+//  any number of processors, including processors running concurrently, and written   //
+//  in the Chrome trace event format read by chrome://tracing and Perfetto. Each        //
+//  process() call is shown as a thread of its own, named for its input.                //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  class trace_log
+  {
+  public:
+    trace_log();
+    ~trace_log();
+
+    //  Writes the events collected so far as a JSON object.
+    void write(std::ostream& os) const;
+
+  private:
+    friend class processor;
+    class impl;
+    boost::scoped_ptr<impl> m_impl;
+
+    trace_log(const trace_log&);             // noncopyable
+    trace_log& operator=(const trace_log&);
+  };
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                  class processor                                     //
+//                                                                                      //
+//  A processor owns everything a run needs: the context stack, the macro table, the    //
+//  options, and the output sink. Separate processor objects share no state, so they   //
+//  may be used concurrently from different threads.                                    //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  class processor
+  {
+  public:
+
+    struct options
+    {
+      options();
+
+      bool           verbose;     // report progress during processing
+      bool           log_input;   // trace each input character
+      bool           log_output;  // trace each output character
+      std::ostream*  log;         // diagnostics and traces; default is &std::cout
+      bool           compile;     // render an input that is reused, by a later
+                                  // process() call sharing the file cache or by a
+                                  // later run sharing its disk cache, from a
+                                  // template compiled once and cached with it,
+                                  // rather than parse the text on every use; an
+                                  // input used once is parsed, which is faster,
+                                  // and loses only the template: macro expansions
+                                  // are memoized, and marker profiles applied, the
+                                  // same way on both paths; default is true.
+                                  // Ignored if log_input or log_output is set.
+      bool           stream;      // process the input file, which may be much larger
+                                  // than memory, in a window of bounded size, and
+                                  // without compiling it; default is false. The
+                                  // window is bounded only on POSIX systems, and
+                                  // only if the file can be memory-mapped; if not,
+                                  // as for a pipe, or a file too large to map on a
+                                  // 32-bit system, the file is read whole.
+      bool           stats;       // report statistics on log after each file;
+                                  // default is false
+      boost::shared_ptr<trace_log>
+                     trace;       // if not null, events are recorded in it
+      boost::shared_ptr<file_cache>
+                     files;       // if null, the processor creates its own
+      marker_profile_map
+                     profiles;    // markers by file extension, for the input file and
+                                  // each file it includes or takes snippets from
+      boost::shared_ptr<const macro_map>
+                     environment; // if not null, the environment variables read by
+                                  // $(name); instead of the process's own
+    };
+
+    explicit processor(const options& opts = options());
+    ~processor();
+
+    //  Defines, or redefines, a macro, as if by a $def command.
+    void define(const std::string& name, const std::string& value);
+
+    //  Defines, or redefines, each of the macros, making room for all of them at once.
+    void define(const macro_map& definitions);
+
+    //  A copy of the macro definitions, made by each call.
+    macro_map macros() const;
+
+    //  The files and environment variables read by the process() calls so far.
+    const dependencies& deps() const;
+
+    //  Processes the file at in_path, writing the results to out. Macros defined by the
+    //  input remain defined for later calls. Returns the number of errors detected.
+    int process(const std::string& in_path, std::ostream& out);
+
+  private:
+    class impl;
+    boost::shared_ptr<file_cache> m_files;
+    boost::scoped_ptr<impl> m_impl;
+
+    processor(const processor&);             // noncopyable
+    processor& operator=(const processor&);
+  };
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                   process_batch                                      //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  struct batch_item
+  {
+    std::string  in_path;
+    std::string  out_path;
+    macro_map    definitions;  // defined after, and so overriding, the common ones
+  };
+
+  //  Processes each item as a separate run, by a new processor with the given options
+  //  and macro definitions, so each output is the same as a single-file run produces.
+  //  Items may name the same input with different definitions, to render one input
+  //  under several configurations; the input and its includes are then loaded and
+  //  compiled once, and rendered from the compiled templates for each configuration
+  //  after the first.
+  //  Items are processed on a pool of threads (0 means one per hardware thread) that
+  //  share a single file_cache. The diagnostics of an item are written to opts.log in
+  //  one piece when the item is complete. If deps is not null, (*deps)[i] receives the
+  //  dependencies of items[i]. Returns the total number of errors detected.
+
+  int process_batch(const std::vector<batch_item>& items,
+    const macro_map& definitions, const processor::options& opts,
+    unsigned threads = 0, std::vector<dependencies>* deps = 0);
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                       watch                                          //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  typedef void (*watch_callback)(const std::vector<batch_item>& items,
+    const std::vector<dependencies>& deps, int error_count);
+
+  //  Processes the items as process_batch() does, then waits for any file read to
+  //  change, and processes again just the items that read the file, for as long as the
+  //  program runs. Input files stay cached between rounds, except those that changed.
+  //  After each round, if rendered is not null, calls it with all the items, the
+  //  latest dependencies of each, and the number of errors detected in the round.
+  //  Changes are detected with inotify on Linux, and by polling file times elsewhere.
+  //  Returns only if changes can't be watched, with the number of errors detected.
+
+  int watch(const std::vector<batch_item>& items, const macro_map& definitions,
+    const processor::options& opts, unsigned threads = 0,
+    watch_callback rendered = 0);
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                       server                                         //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  //  Listens on the Unix domain socket at socket_path, processing one request at a
+  //  time as a single-file run in the client's current directory and environment, with
+  //  the given definitions followed by the request's, and with opts.profiles, except
+  //  for the extensions the request gives profiles for. Loaded files, their snippet
+  //  indexes, and their compiled templates are kept between requests, except for files
+  //  whose time or size has changed. Returns only if the socket can't be listened on.
+
+  int serve(const std::string& socket_path, const macro_map& definitions,
+    const processor::options& opts);
+
+  //  Asks the server at socket_path to process in_path into out_path, as a
+  //  processor with the given definitions and options would, and writes the server's
+  //  diagnostics to *opts.log. The current environment is sent with the request.
+  //  Paths are relative to the current directory. If deps is not null, *deps receives
+  //  the dependencies of the run. Returns the number of errors detected, or -1 if the
+  //  server can't be reached.
+
+  int request(const std::string& socket_path, const std::string& in_path,
+    const std::string& out_path, const macro_map& definitions,
+    const processor::options& opts, dependencies* deps = 0);
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                  class output_file                                   //
+//                                                                                      //
+//  An output file that is replaced only if its contents change, and never left partly  //
+//  written. The output is collected, then compared with the existing file, so an       //
+//  unchanged file keeps its time and costs no output I/O, and a changed file is        //
+//  written in one piece to a temporary file that is renamed over the old one.          //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  class output_file
+  {
+  public:
+    explicit output_file(const std::string& path);
+    ~output_file();  // discards the output if it wasn't committed
+
+    //  The stream to write the output to. The output is held in memory until it grows
+    //  past 64 MB, and from then on in a temporary file beside path.
+    std::ostream& stream();
+
+    //  Replaces the file at path with the output, unless the file already holds the
+    //  same bytes. Readers of path see either the old contents or the new, never a
+    //  mix. If path is a symbolic link, the file it links to is replaced, and the link
+    //  kept. Returns false, leaving path as it was, if the output can't be written.
+    bool commit();
+
+    //  True if commit() replaced the file.
+    bool changed() const;
+
+  private:
+    class impl;
+    boost::scoped_ptr<impl> m_impl;
+
+    output_file(const output_file&);           // noncopyable
+    output_file& operator=(const output_file&);
+  };
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                     depfiles                                         //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+  //  Writes a Make rule, also understood by Ninja, making target depend on deps.files.
+  void write_depfile(std::ostream& os, const std::string& target,
+    const dependencies& deps);
+
+  //  Writes one line per file, "hash  path", and one per environment variable,
+  //  "hash  $(name)", where hash is the 64-bit FNV-1a hash of the file contents or the
+  //  variable's value, as 16 hex digits; it is "-" if the file can't be read or the
+  //  variable isn't set. A build can compare the lines with a previous run's to see
+  //  which inputs actually changed.
+  void write_hashes(std::ostream& os, const dependencies& deps);
+
+}  // namespace mmp
+
+#endif  // MMP_HPP
@@ -0,0 +1,281 @@
+//  output.cpp  ------------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <ostream>
+#include <istream>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/assert.hpp>
+#include <boost/filesystem.hpp>
+
+using std::string;
+namespace fs = boost::filesystem;
+
+namespace
+{
+  const std::size_t spill_size = 64 * 1024 * 1024;  // output held in memory, at most
+  const std::size_t chunk_size = 1024 * 1024;       // of file reads and writes
+
+//-----------------------------------  memory_buf  -------------------------------------//
+
+  class memory_buf : public std::streambuf  // reads a string without copying it
+  {
+  public:
+    explicit memory_buf(const string& s)
+    {
+      char* p = const_cast<char*>(s.data());
+      setg(p, p, p + s.size());
+    }
+  };
+
+//-----------------------------------  same_bytes  -------------------------------------//
+
+  bool same_bytes(std::istream& a, std::istream& b)  // reads both to the end
+  {
+    std::vector<char> abuf(chunk_size), bbuf(chunk_size);
+    for (;;)
+    {
+      a.read(&abuf[0], chunk_size);
+      b.read(&bbuf[0], chunk_size);
+      if (a.gcount() != b.gcount()
+        || std::memcmp(&abuf[0], &bbuf[0], static_cast<std::size_t>(a.gcount())) != 0)
+        return false;
+      if (!a || !b)
+        return !a && !b && !a.bad() && !b.bad();
+    }
+  }
+
+//----------------------------------  resolve_links  -----------------------------------//
+
+  //  The file that writing to path would write, following any symbolic links, even to
+  //  a file that doesn't exist yet. Renaming over this file, rather than over path,
+  //  leaves the links in place.
+
+  string resolve_links(const string& path)
+  {
+    fs::path target(path);
+    boost::system::error_code ec;
+    for (int i = 0; i < 40 && fs::is_symlink(target, ec); ++i)  // 40, as Linux allows
+    {
+      fs::path link(fs::read_symlink(target, ec));
+      if (ec)
+        break;
+      target = link.is_absolute() ? link : target.parent_path() / link;
+    }
+    return target.string();
+  }
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                output_file::impl                                     //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+//  Output is put in a small buffer, which is moved to data when full, or to the
+//  temporary file once data has outgrown spill_size.
+
+class output_file::impl : public std::streambuf
+{
+public:
+  string         path;       // with symbolic links resolved
+  std::ostream   os;
+  string         data;       // the output, unless spilled
+  fs::path       temp;       // empty unless a temporary file exists
+  std::ofstream  temp_os;
+  bool           failed;     // writing the temporary file failed
+  bool           committed;
+  bool           changed;
+
+  explicit impl(const string& p)
+    : path(resolve_links(p)), os(this), failed(false), committed(false),
+      changed(false)
+  {
+    setp(m_buf, m_buf + sizeof(m_buf));
+  }
+
+  ~impl()
+  {
+    if (!temp.empty())
+    {
+      temp_os.close();
+      boost::system::error_code ec;
+      fs::remove(temp, ec);
+    }
+  }
+
+  bool open_temp_()  // true if succeeds
+  {
+    boost::system::error_code ec;
+    fs::path target(path);
+    temp = target.parent_path()
+      / fs::unique_path(target.filename().string() + ".%%%%-%%%%-%%%%.tmp", ec);
+    if (ec)
+    {
+      temp.clear();
+      return false;
+    }
+    m_io.resize(chunk_size);
+    temp_os.rdbuf()->pubsetbuf(&m_io[0], m_io.size());
+    temp_os.open(temp.string().c_str(), std::ios_base::out|std::ios_base::binary);
+    return temp_os.is_open();
+  }
+
+  void move_out_()  // moves the put area to data or the temporary file
+  {
+    std::size_t n = pptr() - pbase();
+    if (temp.empty() && data.size() + n > spill_size)
+    {
+      if (!open_temp_())
+        failed = true;
+      temp_os.write(data.data(), data.size());
+      string().swap(data);
+    }
+    if (temp.empty())
+      data.append(pbase(), n);
+    else if (!temp_os.write(pbase(), n))
+      failed = true;
+    setp(m_buf, m_buf + sizeof(m_buf));
+  }
+
+  bool same_as_file_()  // the output is the same as the contents of path
+  {
+    boost::system::error_code ec;
+    boost::uintmax_t size = fs::file_size(path, ec);
+    if (ec)
+      return false;
+    if (temp.empty())
+    {
+      if (size != data.size())
+        return false;
+      std::ifstream in(path.c_str(), std::ios_base::in|std::ios_base::binary);
+      memory_buf buf(data);
+      std::istream out(&buf);
+      return in && same_bytes(in, out);
+    }
+    if (size != fs::file_size(temp, ec) || ec)
+      return false;
+    std::ifstream in(path.c_str(), std::ios_base::in|std::ios_base::binary);
+    std::ifstream out(temp.string().c_str(), std::ios_base::in|std::ios_base::binary);
+    return in && out && same_bytes(in, out);
+  }
+
+protected:
+  int_type overflow(int_type c)
+  {
+    move_out_();
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n)
+  {
+    if (n <= epptr() - pptr())
+    {
+      std::memcpy(pptr(), s, static_cast<std::size_t>(n));
+      pbump(static_cast<int>(n));
+      return n;
+    }
+    move_out_();
+    if (temp.empty() && data.size() + n <= spill_size)
+      data.append(s, static_cast<std::size_t>(n));  // large writes skip the buffer
+    else
+      return std::streambuf::xsputn(s, n);
+    return n;
+  }
+
+  int sync()
+  {
+    move_out_();
+    return failed ? -1 : 0;
+  }
+
+private:
+  char               m_buf[64 * 1024];
+  std::vector<char>  m_io;  // the temporary file's buffer
+};
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                   output_file                                        //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+output_file::output_file(const string& path) : m_impl(new impl(path)) {}
+
+output_file::~output_file() {}
+
+std::ostream& output_file::stream()
+{
+  return m_impl->os;
+}
+
+bool output_file::changed() const
+{
+  return m_impl->changed;
+}
+
+bool output_file::commit()
+{
+  impl& x(*m_impl);
+  BOOST_ASSERT(!x.committed);
+  x.committed = true;
+  x.os.flush();
+  if (x.failed || !x.os)
+    return false;
+
+  boost::system::error_code ec;
+  if (x.temp.empty())
+  {
+    if (x.same_as_file_())
+      return true;
+    if (!x.open_temp_())
+      return false;
+    x.temp_os.write(x.data.data(), x.data.size());  // one write call, whether or not
+    x.temp_os.close();                              // it fits the buffer
+    if (x.temp_os.fail())
+      return false;  // ~impl() removes the temporary file
+  }
+  else
+  {
+    x.temp_os.close();  // so it can be read back, and renamed on Windows
+    if (x.temp_os.fail())
+      return false;
+    if (x.same_as_file_())
+    {
+      fs::remove(x.temp, ec);
+      x.temp.clear();
+      return true;
+    }
+  }
+
+  fs::file_status st(fs::status(x.path, ec));
+  if (!ec && fs::exists(st))
+    fs::permissions(x.temp, st.permissions(), ec);  // keep the file's permissions
+  fs::rename(x.temp, x.path, ec);
+  if (ec)
+    return false;
+  x.temp.clear();
+  x.changed = true;
+  return true;
+}
+
+}  // namespace mmp
@@ -0,0 +1,4136 @@
+//  processor.cpp  ---------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <boost/assert.hpp>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <map>
+#include <vector>
+#include <tuple>
+#include <utility>
+#include <new>
+#include <cstdlib>   // for getenv()
+#include <ctime>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <streambuf>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem/operations.hpp>
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/mman.h>  // for madvise()
+#endif
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define MMP_SSE2
+# include <emmintrin.h>
+# if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define MMP_AVX2
+#   include <immintrin.h>
+# endif
+#endif
+#include <boost/lexical_cast.hpp>
+
+using std::endl;
+using std::string;
+using std::memcmp;
+using boost::lexical_cast;
+
+/*
+   TODO List
+
+    *  Probable bug if file starts with macro. Add test case of file started by macro.
+    *  Throw on load_file() failure or each use check new_context() return.
+    *  Optimization, better error messages: Don't invoke macro_() for $def, etc.
+    *  environmental variable reference not tested yet
+*/
+
+//--------------------------------------------------------------------------------------//
+
+namespace
+{
+  const string    default_command_start("$");
+  const string    default_command_end(";");
+  const string    default_macro_start("$");
+  const string    default_macro_end(";");
+  const bool      no_macro_check = false;
+  const int       max_expansion_depth = 16;  // of nested calls memoized as one
+  const std::size_t stream_window = 16 * 1024 * 1024;  // bytes of input in memory
+
+  //  The $id blocks of a file are located by one scan, the first time the file is the
+  //  target of a $snippet command, and the resulting index is kept with the contents.
+
+  struct snippet_span
+  {
+    const char*  begin;  // first character of the snippet
+    const char*  end;    // start of the endid command, or 0 if there is none
+    int          line;   // line number of begin
+  };
+  typedef std::map<string, snippet_span> snippet_index;  // key is the id
+
+  //  A file, or the span of a snippet, is compiled once for each set of markers into a
+  //  tree of blocks of instructions, which is kept with the contents of the file and
+  //  rendered by every later $include or $snippet of the same span. Offsets and line
+  //  numbers are relative to the start of the file. The names, values, and paths that
+  //  instructions need are kept once per template, so an instruction owns no memory.
+
+  struct instruction
+  {
+    enum kind_type { text, macro, def, include, snippet, if_, dynamic };
+
+    std::size_t      begin;     // offset of the first character
+    std::size_t      end;       // offset past the last character, and any command-end
+    int              line;      // line number at begin
+    int              end_line;  // line number at end
+    unsigned char    kind;      // a kind_type
+    bool             landed;    // begin was reached by an advance that checks for a
+                                // macro
+    bool             ws_skip;   // begin was reached by skipping whitespace after a
+                                // command
+    boost::uint32_t  name;      // macro, def, or snippet id; index into
+                                // compiled_template::strings
+    boost::uint32_t  value;     // def value, or include or snippet path; ditto
+    boost::uint32_t  lookups;   // the command changes if any of these is defined;
+                                // index into compiled_template::lookups
+    boost::uint32_t  if_index;  // if_: index into compiled_template::ifs
+  };
+
+  struct block  // the instructions of a text
+  {
+    std::vector<instruction>  code;
+    std::size_t  terminator;       // offset of the ending elif, else, endif, or end
+    int          terminator_line;
+    bool         terminator_ws_skip;
+    boost::uint32_t terminator_lookups;  // the terminator is a macro call instead if
+                                         // any of these is defined; as lookups above
+    std::vector<std::pair<std::size_t, std::size_t> >
+                 safe_points;      // (offset, index of code) where a detour may rejoin
+  };
+
+  struct expr_node
+  {
+    string       op;           // "&&", "||", or a relational operator
+    string       lhs, rhs;     // operands of a relational operator
+    std::size_t  left, right;  // operands of "&&" and "||"; indexes into exprs
+  };
+
+  struct if_statement
+  {
+    struct branch
+    {
+      std::size_t  condition;  // index into exprs, or npos for else
+      std::size_t  body;       // index into blocks
+    };
+    std::vector<branch>  branches;
+    int                  line;  // line number of the if expression
+  };
+
+  struct compiled_template
+  {
+    std::vector<block>            blocks;  // blocks[0] is the whole span
+    std::vector<if_statement>     ifs;
+    std::vector<expr_node>        exprs;
+    std::vector<string>           strings;  // each distinct name, value, and path
+    std::vector<boost::uint32_t>  lookups;  // lists of names, each the count followed
+                                            // by indexes into strings; lookups[0]
+                                            // is the empty list
+  };
+
+  typedef boost::shared_ptr<const compiled_template> template_ptr;
+
+  const std::size_t npos = static_cast<std::size_t>(-1);  // no index
+
+  //  command-start, command-end, macro-start, macro-end, span begin, span end
+  typedef std::tuple<string, string, string, string, std::size_t, std::size_t>
+    template_key;
+
+  //  Each input file is memory-mapped once per run and kept in a file cache, so
+  //  contexts for repeated $include or $snippet commands share a single copy of the
+  //  contents.
+
+  struct source_file
+  {
+    boost::interprocess::file_mapping   mapping;
+    boost::interprocess::mapped_region  region;
+    string                              data;   // used if the file can't be mapped
+    const char*                         begin;
+    const char*                         end;
+    std::time_t                         write_time;  // of the file, or -1
+    std::time_t                         load_time;
+    boost::uint64_t                     hash;  // of the contents, if there is a disk
+                                               // cache
+    mutable std::map<string, snippet_index> snippets;  // key is the command-start;
+                                                       // guarded by the cache mutex
+    mutable std::map<template_key, template_ptr> templates;  // guarded by the cache
+                                                             // mutex
+    mutable bool  unsaved;  // snippets or templates aren't all in the disk cache;
+                            // guarded by the cache mutex
+    mutable unsigned long  inputs;  // process() calls it has been the input of;
+                                    // guarded by the cache mutex
+  };
+
+  typedef boost::shared_ptr<const source_file> source_ptr;
+
+//-----------------------------------  macro_table  ------------------------------------//
+
+  //  The macros of a processor. Each name is stored once, with its value, in a vector
+  //  of entries indexed by an open-addressing hash table with linear probing, so a name
+  //  can be looked up from the text it appears in, without first making a string of it.
+  //  Macros are never undefined, so entries are never removed. Values are immutable
+  //  and shared, so the contexts that expand a macro reference its value rather than
+  //  copy it, and redefining the macro doesn't change what they see.
+
+  class macro_table
+  {
+  public:
+    typedef boost::shared_ptr<const string> value_ptr;
+
+    struct entry
+    {
+      string       name;
+      value_ptr    value;
+      std::size_t  hash;
+    };
+
+    macro_table() : m_slots(16, 0), m_generation(0) {}
+
+    //  Returns the value of the name [first, first+n), or 0 if it isn't defined.
+    const value_ptr* find(const char* first, std::size_t n) const
+    {
+      std::size_t h = hash(first, n);
+      for (std::size_t i = h & (m_slots.size() - 1);; i = (i + 1) & (m_slots.size() - 1))
+      {
+        if (!m_slots[i])
+          return 0;
+        const entry& e(m_entries[m_slots[i] - 1]);
+        if (e.hash == h && e.name.size() == n
+          && std::memcmp(e.name.data(), first, n) == 0)
+          return &e.value;
+      }
+    }
+
+    const value_ptr* find(const string& name) const
+      { return find(name.data(), name.size()); }
+
+    //  The value is copied into storage of its own, as it may outlive the render that
+    //  defines it; the name is copied only if it is new.
+    void define(boost::string_ref name, boost::string_ref value)
+    {
+      ++m_generation;
+      std::size_t h = hash(name.data(), name.size());
+      std::size_t i = h & (m_slots.size() - 1);
+      for (; m_slots[i]; i = (i + 1) & (m_slots.size() - 1))
+      {
+        entry& e(m_entries[m_slots[i] - 1]);
+        if (e.hash == h && e.name.size() == name.size()
+          && std::memcmp(e.name.data(), name.data(), name.size()) == 0)
+        {
+          e.value = boost::make_shared<const string>(value.begin(), value.end());
+          return;
+        }
+      }
+
+      entry e = { string(name.begin(), name.end()),
+        boost::make_shared<const string>(value.begin(), value.end()), h };
+      m_entries.push_back(e);
+      m_slots[i] = static_cast<boost::uint32_t>(m_entries.size());
+      if (m_entries.size() * 2 > m_slots.size())
+        rehash(m_slots.size() * 2);
+    }
+
+    //  Makes room for n macros in all, so defining them doesn't rehash.
+    void reserve(std::size_t n)
+    {
+      m_entries.reserve(n);
+      std::size_t slots = m_slots.size();
+      while (n * 2 > slots)
+        slots *= 2;
+      if (slots != m_slots.size())
+        rehash(slots);
+    }
+
+    std::size_t size() const { return m_entries.size(); }
+    unsigned long generation() const { return m_generation; }  // changed by define()
+    const std::vector<entry>& entries() const { return m_entries; }  // in definition
+                                                                     // order
+  private:
+    std::vector<entry>            m_entries;
+    std::vector<boost::uint32_t>  m_slots;  // 0 if empty, else 1 + index of an entry;
+                                            // size() is a power of 2
+    unsigned long                 m_generation;
+
+    static std::size_t hash(const char* p, std::size_t n)  // FNV-1a
+    {
+      std::size_t h = static_cast<std::size_t>(14695981039346656037ULL);
+      for (; n; --n, ++p)
+      {
+        h ^= static_cast<unsigned char>(*p);
+        h *= static_cast<std::size_t>(1099511628211ULL);
+      }
+      return h;
+    }
+
+    void rehash(std::size_t slots)
+    {
+      std::vector<boost::uint32_t>(slots, 0).swap(m_slots);
+      for (std::size_t j = 0; j < m_entries.size(); ++j)
+      {
+        std::size_t i = m_entries[j].hash & (slots - 1);
+        while (m_slots[i])
+          i = (i + 1) & (slots - 1);
+        m_slots[i] = static_cast<boost::uint32_t>(j + 1);
+      }
+    }
+  };
+
+//--------------------------------------  arena  ---------------------------------------//
+
+  //  Storage for the short-lived strings of a render, such as the names, paths, and
+  //  operands a command is parsed into. Allocation bumps a pointer through blocks that
+  //  are kept for the life of the arena, and nothing is freed individually; instead a
+  //  scope rewinds the arena, on exit, to where it was on entry, so no object allocated
+  //  within a scope may outlive it. A processor rewinds its arena between renders, so in
+  //  the steady state its temporaries make no heap allocations at all.
+
+  class arena
+  {
+  public:
+    struct mark_type
+    {
+      std::size_t  block;  // index of the block in use
+      std::size_t  used;   // bytes of it in use
+    };
+
+    class scope
+    {
+    public:
+      explicit scope(arena& a) : m_arena(a), m_mark(a.mark()) {}
+      ~scope() { m_arena.rewind(m_mark); }
+    private:
+      arena&     m_arena;
+      mark_type  m_mark;
+
+      scope(const scope&);  // noncopyable
+      scope& operator=(const scope&);
+    };
+
+    arena() : m_block(0), m_used(0), m_allocations(0), m_bytes(0) {}
+
+    ~arena()
+    {
+      for (std::size_t i = 0; i < m_blocks.size(); ++i)
+        delete [] m_blocks[i].data;
+    }
+
+    void* allocate(std::size_t n)
+    {
+      n = (n + alignment - 1) & ~(alignment - 1);
+      ++m_allocations;
+      m_bytes += n;
+      for (; m_block < m_blocks.size(); ++m_block, m_used = 0)
+        if (m_blocks[m_block].size - m_used >= n)
+          break;
+      if (m_block == m_blocks.size())
+      {
+        std::size_t size = n > block_size ? n : block_size;
+        block b = { new char[size], size };
+        m_blocks.push_back(b);
+        m_used = 0;
+      }
+      void* p = m_blocks[m_block].data + m_used;
+      m_used += n;
+      return p;
+    }
+
+    mark_type mark() const { mark_type m = { m_block, m_used }; return m; }
+    void rewind(const mark_type& m) { m_block = m.block; m_used = m.used; }
+    void reset() { m_block = m_used = 0; }
+
+    unsigned long allocations() const { return m_allocations; }  // since construction
+    unsigned long bytes() const { return m_bytes; }
+    std::size_t blocks() const { return m_blocks.size(); }  // each a heap allocation
+
+  private:
+    static const std::size_t block_size = 64 * 1024;
+    static const std::size_t alignment = 16;
+
+    struct block
+    {
+      char*        data;
+      std::size_t  size;
+    };
+    std::vector<block>  m_blocks;
+    std::size_t         m_block;
+    std::size_t         m_used;
+    unsigned long       m_allocations;
+    unsigned long       m_bytes;
+
+    arena(const arena&);  // noncopyable
+    arena& operator=(const arena&);
+  };
+
+//---------------------------------  arena_allocator  ----------------------------------//
+
+  //  A standard allocator that allocates from an arena. deallocate() does nothing; the
+  //  memory is reclaimed when the arena is rewound.
+
+  template <class T>
+  class arena_allocator
+  {
+  public:
+    typedef T                  value_type;
+    typedef T*                 pointer;
+    typedef const T*           const_pointer;
+    typedef T&                 reference;
+    typedef const T&           const_reference;
+    typedef std::size_t        size_type;
+    typedef std::ptrdiff_t     difference_type;
+    template <class U> struct rebind { typedef arena_allocator<U> other; };
+
+    explicit arena_allocator(arena& a) : m_arena(&a) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U>& other) : m_arena(other.m_arena) {}
+
+    pointer allocate(size_type n, const void* = 0)
+      { return static_cast<pointer>(m_arena->allocate(n * sizeof(T))); }
+    void deallocate(pointer, size_type) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+    void construct(pointer p, const T& x) { new (static_cast<void*>(p)) T(x); }
+    void destroy(pointer p) { p->~T(); }
+
+    arena* m_arena;  // public for the converting constructor
+  };
+
+  template <class T, class U>
+  bool operator==(const arena_allocator<T>& x, const arena_allocator<U>& y)
+    { return x.m_arena == y.m_arena; }
+
+  template <class T, class U>
+  bool operator!=(const arena_allocator<T>& x, const arena_allocator<U>& y)
+    { return x.m_arena != y.m_arena; }
+
+  typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> >
+    scratch_string;
+
+//-----------------------------------  find_either  ------------------------------------//
+
+  //  find_either(first, last, a, b) returns a pointer to the first character in
+  //  [first, last) equal to a or b, or last if there is none. It is the inner loop of
+  //  marker scanning, so the implementation is chosen once at startup from the
+  //  instruction sets the processor supports.
+
+  const char* find_either_portable(const char* first, const char* last, char a, char b)
+  {
+    if (a == b)
+    {
+      const void* p = std::memchr(first, a, last - first);
+      return p ? static_cast<const char*>(p) : last;
+    }
+    for (; first != last && *first != a && *first != b; ++first) {}
+    return first;
+  }
+
+#ifdef MMP_SSE2
+  inline int lowest_bit(unsigned mask)
+  {
+# ifdef __GNUC__
+    return __builtin_ctz(mask);
+# else
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return static_cast<int>(i);
+# endif
+  }
+
+  const char* find_either_sse2(const char* first, const char* last, char a, char b)
+  {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    for (; last - first >= 16; first += 16)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb))));
+      if (mask)
+        return first + lowest_bit(mask);
+    }
+    return find_either_portable(first, last, a, b);
+  }
+#endif
+
+#ifdef MMP_AVX2
+  __attribute__((target("avx2")))
+  const char* find_either_avx2(const char* first, const char* last, char a, char b)
+  {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    for (; last - first >= 32; first += 32)
+    {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb))));
+      if (mask)
+        return first + lowest_bit(mask);
+    }
+    return find_either_sse2(first, last, a, b);
+  }
+#endif
+
+  typedef const char* (*find_either_type)(const char*, const char*, char, char);
+
+  find_either_type select_find_either()
+  {
+#if defined(MMP_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+      return find_either_avx2;
+#endif
+#if defined(MMP_SSE2)
+    return find_either_sse2;
+#else
+    return find_either_portable;
+#endif
+  }
+
+  const find_either_type find_either = select_find_either();
+
+//----------------------------------  marker matching  ---------------------------------//
+
+  //  Nearly every file uses the default markers, each a single character, so the loops
+  //  that scan for markers are templates over how a marker is matched, and the choice
+  //  is made once for each set of markers. For single_byte_markers a match is a byte
+  //  compare, and the first byte found by find_either() is the whole marker.
+
+  struct single_byte_markers
+  {
+    static bool fits(const string& command_start, const string& command_end,
+      const string& macro_start, const string& macro_end)
+    {
+      return command_start.size() == 1 && command_end.size() == 1
+        && macro_start.size() == 1 && macro_end.size() == 1;
+    }
+
+    static bool at(const char* p, const char* end, const string& marker)
+    {
+      return p != end && *p == marker[0];
+    }
+  };
+
+  struct any_markers
+  {
+    static bool at(const char* p, const char* end, const string& marker)
+    {
+      return static_cast<std::size_t>(end - p) >= marker.size()
+        && std::memcmp(p, marker.data(), marker.size()) == 0;
+    }
+  };
+
+  //  The first position in [p, end) holding marker a or marker b, or end if none.
+  template <class Match>
+  const char* find_marker(const char* p, const char* end, const string& a,
+    const string& b)
+  {
+    for (; (p = find_either(p, end, a[0], b[0])) != end; ++p)
+      if (Match::at(p, end, a) || Match::at(p, end, b))
+        return p;
+    return end;
+  }
+
+  template <>
+  const char* find_marker<single_byte_markers>(const char* p, const char* end,
+    const string& a, const string& b)
+  {
+    return find_either(p, end, a[0], b[0]);
+  }
+
+//---------------------------------  marker_scanner  -----------------------------------//
+
+  //  Finds the first of two markers of any length in one pass over the text, with an
+  //  Aho-Corasick automaton whose failure links are folded into a full transition
+  //  table. Only a byte that begins a marker leaves the start state, so while in it the
+  //  text is skipped by find_either().
+
+  class marker_scanner
+  {
+  public:
+    marker_scanner(const string& a, const string& b)
+      : m_next(256, 0), m_depth(1, 0), m_match(1, 0), m_a(a[0]), m_b(b[0])
+    {
+      std::vector<unsigned> fail(1, 0);
+      add_(a);
+      add_(b);
+      fail.resize(m_depth.size(), 0);
+
+      // breadth first, so the failure state of each state is complete before it
+      std::deque<unsigned> queue;
+      for (unsigned c = 0; c < 256; ++c)
+        if (m_next[c])
+          queue.push_back(m_next[c]);
+      for (; !queue.empty(); queue.pop_front())
+      {
+        unsigned s = queue.front();
+        if (m_match[fail[s]] > m_match[s])
+          m_match[s] = m_match[fail[s]];
+        for (unsigned c = 0; c < 256; ++c)
+        {
+          unsigned& t(m_next[s * 256 + c]);
+          if (t)
+          {
+            fail[t] = m_next[fail[s] * 256 + c];
+            queue.push_back(t);
+          }
+          else
+            t = m_next[fail[s] * 256 + c];
+        }
+      }
+    }
+
+    //  The first position in [p, limit) where a marker starts, or limit if none. A
+    //  marker starting before limit may extend up to end.
+    const char* find(const char* p, const char* limit, const char* end) const
+    {
+      const char* best = limit;
+      unsigned s = 0;
+      while (p != end)
+      {
+        if (!s && (p = find_either(p, limit, m_a, m_b)) == limit)
+          return limit;
+        s = m_next[s * 256 + static_cast<unsigned char>(*p++)];
+        if (m_match[s] && p - m_match[s] < best)
+          best = p - m_match[s];  // the longest match ending here starts first
+        if (p - m_depth[s] >= best)
+          return best;  // no partial match can start before best
+      }
+      return best;
+    }
+
+  private:
+    std::vector<unsigned>  m_next;   // [state * 256 + byte]; 0 is the start state
+    std::vector<unsigned>  m_depth;  // length of the text the state has matched
+    std::vector<unsigned>  m_match;  // length of the longest marker ending there, or 0
+    char                   m_a;      // first byte of each marker
+    char                   m_b;
+
+    void add_(const string& marker)
+    {
+      unsigned s = 0;
+      for (string::const_iterator it = marker.begin(); it != marker.end(); ++it)
+      {
+        unsigned& t(m_next[s * 256 + static_cast<unsigned char>(*it)]);
+        if (!t)
+        {
+          t = static_cast<unsigned>(m_depth.size());
+          m_depth.push_back(m_depth[s] + 1);
+          m_match.push_back(0);
+          m_next.resize(m_next.size() + 256, 0);  // invalidates t
+        }
+        s = m_next[s * 256 + static_cast<unsigned char>(*it)];
+      }
+      m_match[s] = static_cast<unsigned>(marker.size());
+    }
+  };
+
+//-----------------------------------  marker_set  -------------------------------------//
+
+  struct marker_set
+  {
+    string  command_start;  // command start marker; !empty()
+    string  command_end;    // command end marker; may be empty()
+    string  macro_start_;   // !empty()
+    string  macro_end_;     // !empty()
+    bool    single_byte;    // each marker is one character
+    boost::shared_ptr<const marker_scanner>
+            scanner;        // for command_start and macro_start_, unless single_byte
+
+    //  Position of the first command-start or macro-start in [p, limit), or limit
+    const char* next_marker(const char* p, const char* limit, const char* end) const
+    {
+      return single_byte ? find_either(p, limit, command_start[0], macro_start_[0])
+        : scanner->find(p, limit, end);
+    }
+  };
+
+//------------------------------------  compiler  --------------------------------------//
+
+  //  Compiles a span of a file into a compiled_template. The compiler follows the text
+  //  parser of processor::impl position by position, but has no side effects and reports
+  //  no errors. A construct whose effect could depend on macro definitions other than
+  //  through a simple lookup, or that would report an error, becomes a dynamic
+  //  instruction, which the renderer hands to the text parser.
+  //
+  //  Whether a position is "landed", i.e. reached by an advance() that checks for a
+  //  macro-start, is tracked because only then is a macro-start there expanded.
+  //
+  //  Match is single_byte_markers or any_markers, as the markers allow.
+
+  template <class Match>
+  class compiler
+  {
+  public:
+    compiler(const char* origin, const char* end, const marker_set& markers,
+      compiled_template& t)
+      : m_origin(origin), m_end(end), m_markers(markers),
+        m_cs(markers.command_start), m_ce(markers.command_end),
+        m_ms(markers.macro_start_), m_me(markers.macro_end_), m_t(t),
+        m_line_pos(origin), m_line(1)
+    {}
+
+    void compile(const char* begin)
+    {
+      m_t.lookups.assign(1, 0);
+      m_t.blocks.push_back(block());
+      compile_block(0, begin, false);
+    }
+
+  private:
+    const char*         m_origin;  // start of the file
+    const char*         m_end;
+    const marker_set&   m_markers;
+    const string&       m_cs;
+    const string&       m_ce;
+    const string&       m_ms;
+    const string&       m_me;
+    compiled_template&  m_t;
+    std::map<string, boost::uint32_t>
+                        m_strings;   // index of each string in m_t.strings
+    const char*         m_line_pos;  // line() memo
+    int                 m_line;
+
+    boost::uint32_t intern(const string& s)  // index of s in m_t.strings
+    {
+      std::pair<std::map<string, boost::uint32_t>::iterator, bool> result(
+        m_strings.insert(std::make_pair(s,
+          static_cast<boost::uint32_t>(m_t.strings.size()))));
+      if (result.second)
+        m_t.strings.push_back(s);
+      return result.first->second;
+    }
+
+    boost::uint32_t lookup_list(const std::vector<string>& names)  // index in m_t.lookups
+    {
+      if (names.empty())
+        return 0;
+      boost::uint32_t list = static_cast<boost::uint32_t>(m_t.lookups.size());
+      m_t.lookups.push_back(static_cast<boost::uint32_t>(names.size()));
+      for (std::vector<string>::const_iterator it = names.begin(); it != names.end();
+        ++it)
+        m_t.lookups.push_back(intern(*it));
+      return list;
+    }
+
+    bool at(const char* p, const string& marker) const  // marker is one of the four
+    {
+      return Match::at(p, m_end, marker);
+    }
+
+    bool at(const char* p, const char* s) const
+    {
+      std::size_t n = std::strlen(s);
+      return static_cast<std::size_t>(m_end - p) >= n && std::memcmp(p, s, n) == 0;
+    }
+
+    std::size_t offset(const char* p) const { return p - m_origin; }
+
+    int line(const char* p)
+    {
+      if (p < m_line_pos)
+      {
+        m_line_pos = m_origin;
+        m_line = 1;
+      }
+      m_line += static_cast<int>(std::count(m_line_pos, p, '\n'));
+      m_line_pos = p;
+      return m_line;
+    }
+
+    const char* skip_ws(const char* p) const
+    {
+      for (; p != m_end && std::isspace(*p); ++p) {}
+      return p;
+    }
+
+    const char* name_end(const char* p) const
+    {
+      for (; p != m_end && (std::isalnum(*p) || *p == '_'); ++p) {}
+      return p;
+    }
+
+    bool has_macro_start(const char* first, const char* last) const  // in [first, last)
+    {
+      if (last > m_end)
+        last = m_end;
+      for (; (first = find_either(first, last, m_ms[0], m_ms[0])) != last; ++first)
+        if (at(first, m_ms))  // which may extend past last
+          return true;
+      return false;
+    }
+
+    //  Position of the first command-start or macro-start after p, as next_marker()
+    const char* next_marker(const char* p) const
+    {
+      return m_markers.next_marker(p + 1, m_end, m_end);
+    }
+
+    //  As is_command(), skip_command()
+    bool is_command(const char* p, const char* x) const
+    {
+      if (!at(p, m_cs))
+        return false;
+      p = skip_ws(p + m_cs.size());
+      for (; *x && p != m_end && *p == *x; ++p, ++x) {}
+      return !*x && (p == m_end || !std::isalpha(*p));
+    }
+
+    bool is_terminator(const char* p) const
+    {
+      return is_command(p, "elif") || is_command(p, "else") || is_command(p, "endif");
+    }
+
+    bool is_keyword(const char* p) const
+    {
+      return is_command(p, "def") || is_command(p, "include")
+        || is_command(p, "snippet") || is_command(p, "if") || is_terminator(p);
+    }
+
+    const char* skip_command(const char* p) const
+    {
+      p = skip_ws(p + m_cs.size());
+      for (; p != m_end && std::isalpha(*p); ++p) {}
+      return p;
+    }
+
+    //  As the command-end handling of text_(), given whether p is landed; reports
+    //  whether the next position is landed, and whether it was reached by skipping
+    //  whitespace.
+    const char* command_end(const char* p, bool p_landed, bool& landed, bool& ws_skip)
+      const
+    {
+      if (at(p, m_ce))
+      {
+        landed = ws_skip = false;
+        return p + m_ce.size();
+      }
+      const char* next = skip_ws(p);
+      landed = next != p || p_landed;
+      ws_skip = next != p && at(next, m_ms);
+      return next;
+    }
+
+    //  A command-start at p that is also a landed macro-start is pushed as raw text by
+    //  macro_call_(), and then parsed as a command, unless its name is a defined macro.
+    //  Returns false if the call is not of that form.
+    bool landing(const char* p, std::vector<string>& lookups) const
+    {
+      const char* q = p + m_ms.size();
+      if (at(q, m_me) || q == m_end || *q == '(')
+        return false;
+      const char* r = name_end(q);
+      if (r == q || r == m_end || has_macro_start(q + 1, r + 1))
+        return false;
+      if (at(r, m_me))
+        lookups.push_back(string(q, r));
+      return true;
+    }
+
+//  live parsers; return 0 if a string has no closing quote
+
+    const char* name_(const char* p, string& s) const
+    {
+      p = skip_ws(p);
+      const char* e = name_end(p);
+      s.assign(p, e);
+      return e;
+    }
+
+    const char* string_(const char* p, string& s) const
+    {
+      p = skip_ws(p);
+      if (p == m_end || *p != '"')
+        return name_(p, s);
+      const char* e = std::find(p + 1, m_end, '"');
+      if (e == m_end)
+        return 0;
+      s.assign(p + 1, e);
+      return e + 1;
+    }
+
+    bool operator_(const char*& p, const char* op) const  // as advance_if_operator()
+    {
+      const char* q = skip_ws(p);
+      if (!at(q, op))
+        return false;
+      p = q + std::strlen(op);
+      return true;
+    }
+
+    std::size_t node(const char* op, std::size_t left, std::size_t right)
+    {
+      expr_node n;
+      n.op = op;
+      n.left = left;
+      n.right = right;
+      m_t.exprs.push_back(n);
+      return m_t.exprs.size() - 1;
+    }
+
+    std::size_t primary_expr_(const char*& p)  // npos if not well-formed
+    {
+      if (operator_(p, "("))
+      {
+        std::size_t e = expression_(p);
+        if (e == npos)
+          return npos;
+        p = skip_ws(p);
+        if (p == m_end || *p != ')')
+          return npos;
+        ++p;
+        return e;
+      }
+
+      expr_node n;
+      n.left = n.right = npos;
+      if (!(p = string_(p, n.lhs)))
+        return npos;
+      p = skip_ws(p);
+      if (p == m_end || !*p)
+        return npos;
+      if (std::strchr("=!<>", *p))
+        n.op += *p++;
+      if (p != m_end && *p == '=')
+      {
+        n.op += '=';
+        ++p;
+      }
+      if (!(p = string_(p, n.rhs)))
+        return npos;
+      if (n.op != "==" && n.op != "!=" && n.op != "<" && n.op != "<="
+        && n.op != ">" && n.op != ">=")
+        return npos;
+      m_t.exprs.push_back(n);
+      return m_t.exprs.size() - 1;
+    }
+
+    std::size_t and_expr_(const char*& p)
+    {
+      std::size_t left = primary_expr_(p);
+      while (left != npos && operator_(p, "&&"))
+      {
+        std::size_t right = primary_expr_(p);
+        left = right == npos ? npos : node("&&", left, right);
+      }
+      return left;
+    }
+
+    std::size_t expression_(const char*& p)
+    {
+      std::size_t left = and_expr_(p);
+      while (left != npos && operator_(p, "||"))
+      {
+        std::size_t right = and_expr_(p);
+        left = right == npos ? npos : node("||", left, right);
+      }
+      return left;
+    }
+
+//  skip mode parsers; as the skip mode of processor::impl, but return 0 where it would
+//  reach the end of the content or report an error
+
+    const char* skip_string_(const char* p) const
+    {
+      p = skip_ws(p);
+      if (p != m_end && *p == '"')
+      {
+        p = std::find(p + 1, m_end, '"');
+        return p == m_end ? p : p + 1;
+      }
+      while (p != m_end)
+      {
+        if (std::isalnum(*p) || *p == '_')
+          ++p;
+        else if (at(p, m_ms))
+        {
+          p += m_ms.size();
+          if (p != m_end && *p == '(')
+            ++p;
+          p = name_end(p);
+          if (p != m_end && *p == ')')
+            ++p;
+          if (at(p, m_me))
+            p += m_me.size();
+        }
+        else
+          break;
+      }
+      return p;
+    }
+
+    bool skip_if_operator(const char*& p, const char* op) const
+    {
+      p = skip_ws(p);
+      if (!at(p, op))
+        return false;
+      p += std::strlen(op);
+      return true;
+    }
+
+    const char* skip_primary_expr_(const char* p) const
+    {
+      if (skip_if_operator(p, "("))
+      {
+        p = skip_expression_(p);
+        skip_if_operator(p, ")");
+        return p;
+      }
+      p = skip_ws(skip_string_(p));
+      for (int i = 0; i < 2 && p != m_end && std::strchr("=!<>", *p); ++i)
+        ++p;
+      return skip_string_(p);
+    }
+
+    const char* skip_and_expr_(const char* p) const
+    {
+      p = skip_primary_expr_(p);
+      while (skip_if_operator(p, "&&"))
+        p = skip_primary_expr_(p);
+      return p;
+    }
+
+    const char* skip_expression_(const char* p) const
+    {
+      p = skip_and_expr_(p);
+      while (skip_if_operator(p, "||"))
+        p = skip_and_expr_(p);
+      return p;
+    }
+
+    const char* skip_if_body_(const char* p) const
+    {
+      if (!(p = skip_text_(skip_expression_(p))))
+        return 0;
+      while (is_command(p, "elif"))
+        if (!(p = skip_text_(skip_expression_(skip_command(p)))))
+          return 0;
+      if (is_command(p, "else"))
+        if (!(p = skip_text_(skip_command(p))))
+          return 0;
+      if (!is_command(p, "endif"))
+        return 0;
+      return std::min(p + m_cs.size() + 5, m_end);
+    }
+
+    const char* skip_text_(const char* p) const  // the terminator, or 0
+    {
+      for (;;)
+      {
+        if ((p = find_marker<Match>(p, m_end, m_cs, m_cs)) == m_end)
+          return 0;
+        if (is_terminator(p))
+          return p;
+
+        if (is_command(p, "if"))
+        {
+          if (!(p = skip_if_body_(skip_command(p))))
+            return 0;
+        }
+        else if (is_command(p, "def") || is_command(p, "snippet"))
+          p = skip_string_(skip_string_(skip_command(p)));
+        else if (is_command(p, "include"))
+          p = skip_string_(skip_command(p));
+        else
+        {
+          p += m_cs.size();
+          continue;
+        }
+
+        if (p != m_end && at(p, m_ce))
+          p += m_ce.size();
+        else
+          p = skip_ws(p);
+      }
+    }
+
+//  instructions
+
+    //  Compiles the text beginning at p into m_t.blocks[bi]; returns the terminating
+    //  elif, else, or endif, or 0 if the end is reached.
+    const char* compile_block(std::size_t bi, const char* p, bool landed)
+    {
+      block b;
+      b.terminator_lookups = 0;
+      bool ws_skip = false;
+
+      while (p != m_end)
+      {
+        instruction in;
+        in.kind = instruction::text;
+        in.begin = offset(p);
+        in.line = line(p);
+        in.landed = landed;
+        in.ws_skip = ws_skip;
+        in.name = in.value = in.lookups = in.if_index = 0;
+
+        const char* next;
+        if (at(p, m_cs) && !(landed && at(p, m_ms) && !is_keyword(p)))
+        {
+          std::vector<string> lookups;
+          if (landed && at(p, m_ms) && !landing(p, lookups))
+            next = dynamic_call(in, p, landed, ws_skip);
+          else if (is_terminator(p))
+          {
+            b.terminator_lookups = lookup_list(lookups);
+            break;
+          }
+          else
+          {
+            in.lookups = lookup_list(lookups);
+            next = command(in, p, landed, ws_skip);
+          }
+        }
+        else if (landed && at(p, m_ms))
+          next = macro_call(in, p, landed, ws_skip);
+        else
+        {
+          if (!at(p, m_ms))
+            b.safe_points.push_back(std::make_pair(in.begin, b.code.size()));
+          next = next_marker(p);
+          landed = true;
+          ws_skip = false;
+        }
+
+        in.end = offset(next);
+        in.end_line = line(next);
+        b.code.push_back(in);
+        p = next;
+      }
+
+      b.terminator = offset(p);
+      b.terminator_line = line(p);
+      b.terminator_ws_skip = ws_skip;
+      std::swap(m_t.blocks[bi], b);  // nested blocks may have reallocated m_t.blocks
+      return p == m_end ? 0 : p;
+    }
+
+    std::size_t new_block()
+    {
+      m_t.blocks.push_back(block());
+      return m_t.blocks.size() - 1;
+    }
+
+    //  A macro call the renderer leaves to macro_call_(); the parse continues after its
+    //  syntax, which is where the text parser is likely to resume.
+    const char* dynamic_call(instruction& in, const char* p, bool& landed,
+      bool& ws_skip) const
+    {
+      in.kind = instruction::dynamic;
+      landed = true;
+      ws_skip = false;
+      p += m_ms.size();
+      if (at(p, m_me))
+        return p + m_me.size();
+      if (p != m_end && *p == '(')
+        ++p;
+      p = name_end(p);
+      if (p != m_end && *p == ')')
+        ++p;
+      return at(p, m_me) ? p + m_me.size() : p;
+    }
+
+    const char* macro_call(instruction& in, const char* p, bool& landed, bool& ws_skip)
+    {
+      const char* q = p + m_ms.size();
+      const char* r = name_end(q);
+      if (r == q || !at(r, m_me) || has_macro_start(q + 1, r + 1))
+        return dynamic_call(in, p, landed, ws_skip);
+      in.kind = instruction::macro;
+      in.name = intern(string(q, r));
+      landed = true;
+      ws_skip = false;
+      return r + m_me.size();
+    }
+
+    const char* command(instruction& in, const char* p, bool& landed, bool& ws_skip)
+    {
+      const char* q = p + m_cs.size();
+      string keyword, name, value;
+      const char* k_end = name_(q, keyword);
+      const char* a = 0;  // past the arguments
+
+      if (keyword == "def")
+      {
+        in.kind = instruction::def;
+        a = string_(name_(k_end, name), value);
+      }
+      else if (keyword == "include")
+      {
+        in.kind = instruction::include;
+        a = string_(k_end, value);
+      }
+      else if (keyword == "snippet")
+      {
+        in.kind = instruction::snippet;
+        a = string_(name_(k_end, name), value);
+      }
+      else if (keyword == "if")
+        return compile_if(in, q, k_end, landed, ws_skip);
+
+      if (a && a != m_end && !has_macro_start(q + 1, a + 1))
+      {
+        in.name = intern(name);
+        in.value = intern(value);
+        if (in.kind != instruction::def)  // parsing continues in the new context
+        {
+          landed = true;
+          ws_skip = false;
+          return a;
+        }
+        const char* next = command_end(a, true, landed, ws_skip);
+        if (next != m_end || at(a, m_ce))  // else skip_whitespace() would go on in the
+          return next;                     // including context
+      }
+
+      in.kind = instruction::dynamic;
+      if (keyword == "def" || keyword == "snippet")
+        return command_end(skip_string_(skip_string_(k_end)), true, landed, ws_skip);
+      if (keyword == "include")
+      {
+        landed = true;
+        ws_skip = false;
+        return skip_string_(k_end);
+      }
+      return command_end(k_end, true, landed, ws_skip);
+    }
+
+    //  An if compiles only if every branch, whether it is rendered or skipped, ends at
+    //  the same elif, else, or endif, so that the branches have fixed positions.
+    const char* compile_if(instruction& in, const char* q, const char* k_end,
+      bool& landed, bool& ws_skip)
+    {
+      std::size_t blocks = m_t.blocks.size(), ifs = m_t.ifs.size(),
+        exprs = m_t.exprs.size();
+      if_statement s;
+      s.line = line(k_end);
+
+      const char* p = k_end;   // start of the branch text
+      const char* t = 0;       // end of the branch text
+      bool ok = true;
+      bool else_seen = false;
+      for (const char* k = 0; ok; )  // k is past the elif or else keyword
+      {
+        if_statement::branch br;
+        br.condition = npos;
+        if (!else_seen)
+        {
+          br.condition = expression_(p);
+          ok = br.condition != npos && !has_macro_start(k ? k : q + 1, p + 1);
+        }
+        if (ok)
+        {
+          br.body = new_block();
+          t = compile_block(br.body, p, !else_seen);
+          ok = t && skip_text_(p) == t && (!k || skip_text_(k) == t);
+        }
+        if (!ok)
+          break;
+        s.branches.push_back(br);
+
+        if (is_command(t, "endif"))
+          break;
+        if (else_seen)
+          ok = false;
+        else_seen = is_command(t, "else");
+        p = k = skip_command(t);
+      }
+
+      const char* a = t ? t + m_cs.size() + 5 : 0;  // past the endif
+      if (ok && at(t + m_cs.size(), "endif") && a != m_end)
+      {
+        const char* next = command_end(a, false, landed, ws_skip);
+        if (next != m_end || at(a, m_ce))
+        {
+          in.kind = instruction::if_;
+          in.if_index = static_cast<boost::uint32_t>(m_t.ifs.size());
+          m_t.ifs.push_back(s);
+          return next;
+        }
+      }
+
+      m_t.blocks.resize(blocks);
+      m_t.ifs.resize(ifs);
+      m_t.exprs.resize(exprs);
+      in.kind = instruction::dynamic;
+      const char* end_if = skip_if_body_(k_end);
+      return end_if ? command_end(end_if, false, landed, ws_skip)
+        : command_end(k_end, true, landed, ws_skip);
+    }
+  };
+
+  void compile_template(const char* origin, const char* begin, const char* end,
+    const marker_set& markers, compiled_template& t)
+  {
+    if (markers.single_byte)
+      compiler<single_byte_markers>(origin, end, markers, t).compile(begin);
+    else
+      compiler<any_markers>(origin, end, markers, t).compile(begin);
+  }
+
+  //  Pure, since an expression is compiled only if it contains no macro-start
+  bool evaluate(const compiled_template& t, std::size_t i)
+  {
+    const expr_node& e(t.exprs[i]);
+    if (e.op == "&&")
+      return evaluate(t, e.left) && evaluate(t, e.right);
+    if (e.op == "||")
+      return evaluate(t, e.left) || evaluate(t, e.right);
+    if (e.op == "==")
+      return e.lhs == e.rhs;
+    if (e.op == "!=")
+      return e.lhs != e.rhs;
+    if (e.op == "<")
+      return e.lhs < e.rhs;
+    if (e.op == "<=")
+      return e.lhs <= e.rhs;
+    if (e.op == ">")
+      return e.lhs > e.rhs;
+    return e.lhs >= e.rhs;
+  }
+
+//------------------------------------  disk cache  ------------------------------------//
+
+  //  With file_cache::persist(), the snippet indexes and compiled templates of each file
+  //  are also kept in a directory, one entry per file, so that later runs can map them
+  //  in rather than scan and compile the file again. An entry is named for a hash of
+  //  the file's path, and is used only if the path, size, time, and a hash of the
+  //  contents all match the file's. After a fixed header, integers are stored in as
+  //  few bytes as they need, and strings and vectors are preceded by their size.
+
+  const boost::uint64_t cache_magic = 0x45484341434d4d50ULL;  // "PMMCACHE" stored
+  const boost::uint64_t cache_version = 2;  // of the entry format
+
+  boost::uint64_t fnv1a_hash(const char* p, std::size_t n)
+  {
+    boost::uint64_t h = 14695981039346656037ULL;
+    for (; n; --n, ++p)
+    {
+      h ^= static_cast<unsigned char>(*p);
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  string cache_entry_path(const string& directory, const string& path)
+  {
+    static const char digits[] = "0123456789abcdef";
+    boost::uint64_t h = fnv1a_hash(path.data(), path.size());
+    string name(16, '0');
+    for (int i = 15; i >= 0; --i, h >>= 4)
+      name[i] = digits[h & 0xf];
+    return (boost::filesystem::path(directory) / (name + ".mmpc")).string();
+  }
+
+//-----------------------------------  cache_writer  -----------------------------------//
+
+  class cache_writer
+  {
+  public:
+    void put(boost::uint64_t n)  // seven bits a byte, low first, high bit set if more
+    {
+      for (; n >= 0x80; n >>= 7)
+        m_data += static_cast<char>((n & 0x7f) | 0x80);
+      m_data += static_cast<char>(n);
+    }
+
+    void put_signed(boost::int64_t n)  // zigzag, so small negatives stay small
+    {
+      put(static_cast<boost::uint64_t>(n) << 1 ^ static_cast<boost::uint64_t>(n >> 63));
+    }
+
+    void put_fixed(boost::uint64_t n)
+    {
+      char bytes[8];
+      for (int i = 0; i < 8; ++i, n >>= 8)
+        bytes[i] = static_cast<char>(n & 0xff);
+      m_data.append(bytes, 8);
+    }
+
+    void put(const string& s)
+    {
+      put(s.size());
+      m_data += s;
+    }
+
+    void put(const std::vector<string>& v)
+    {
+      put(v.size());
+      for (std::vector<string>::const_iterator it = v.begin(); it != v.end(); ++it)
+        put(*it);
+    }
+
+    void put(const compiled_template& t)
+    {
+      put(t.blocks.size());
+      for (std::vector<block>::const_iterator b = t.blocks.begin(); b != t.blocks.end();
+        ++b)
+      {
+        put(b->code.size());
+        for (std::vector<instruction>::const_iterator in = b->code.begin();
+          in != b->code.end(); ++in)
+        {
+          put(static_cast<boost::uint64_t>(in->kind));
+          put(in->begin);
+          put(in->end);
+          put_signed(in->line);
+          put_signed(in->end_line);
+          put(in->landed);
+          put(in->ws_skip);
+          put(in->name);
+          put(in->value);
+          put(in->lookups);
+          put(in->if_index);
+        }
+        put(b->terminator);
+        put_signed(b->terminator_line);
+        put(b->terminator_ws_skip);
+        put(b->terminator_lookups);
+        put(b->safe_points.size());
+        for (std::size_t i = 0; i < b->safe_points.size(); ++i)
+        {
+          put(b->safe_points[i].first);
+          put(b->safe_points[i].second);
+        }
+      }
+
+      put(t.ifs.size());
+      for (std::vector<if_statement>::const_iterator s = t.ifs.begin(); s != t.ifs.end();
+        ++s)
+      {
+        put(s->branches.size());
+        for (std::size_t i = 0; i < s->branches.size(); ++i)
+        {
+          put(s->branches[i].condition);
+          put(s->branches[i].body);
+        }
+        put_signed(s->line);
+      }
+
+      put(t.exprs.size());
+      for (std::vector<expr_node>::const_iterator e = t.exprs.begin(); e != t.exprs.end();
+        ++e)
+      {
+        put(e->op);
+        put(e->lhs);
+        put(e->rhs);
+        put(e->left);
+        put(e->right);
+      }
+
+      put(t.strings);
+      put(t.lookups.size());
+      for (std::size_t i = 0; i < t.lookups.size(); ++i)
+        put(t.lookups[i]);
+    }
+
+    string& data() { return m_data; }
+
+  private:
+    string  m_data;
+  };
+
+//-----------------------------------  cache_reader  -----------------------------------//
+
+  //  Reads what a cache_writer wrote. Reading past the end, or a size larger than the
+  //  data left, makes the reader fail, after which every read returns zero or empty.
+
+  class cache_reader
+  {
+  public:
+    cache_reader(const char* first, const char* last)
+      : m_p(first), m_end(last), m_ok(true) {}
+
+    bool ok() const { return m_ok; }
+    bool at_end() const { return m_p == m_end; }
+
+    boost::uint64_t get()
+    {
+      boost::uint64_t n = 0;
+      for (int shift = 0; shift < 64; shift += 7)
+      {
+        if (m_p == m_end)
+          return fail();
+        unsigned char c = static_cast<unsigned char>(*m_p++);
+        n |= static_cast<boost::uint64_t>(c & 0x7f) << shift;
+        if (!(c & 0x80))
+          return n;
+      }
+      return fail();
+    }
+
+    boost::uint64_t get_fixed()
+    {
+      if (m_end - m_p < 8)
+        return fail();
+      boost::uint64_t n = 0;
+      for (int i = 7; i >= 0; --i)
+        n = n << 8 | static_cast<unsigned char>(m_p[i]);
+      m_p += 8;
+      return n;
+    }
+
+    std::size_t get_size()  // of something taking at least a byte per element
+    {
+      boost::uint64_t n = get();
+      return n <= static_cast<boost::uint64_t>(m_end - m_p)
+        ? static_cast<std::size_t>(n) : static_cast<std::size_t>(fail());
+    }
+
+    std::size_t get_index()  // an offset, index, or npos
+    {
+      boost::uint64_t n = get();
+      return n == static_cast<boost::uint64_t>(-1) ? npos : static_cast<std::size_t>(n);
+    }
+
+    boost::int64_t get_signed()
+    {
+      boost::uint64_t n = get();
+      return static_cast<boost::int64_t>(n >> 1 ^ (0 - (n & 1)));
+    }
+
+    int get_int() { return static_cast<int>(get_signed()); }
+    boost::uint32_t get_uint32() { return static_cast<boost::uint32_t>(get()); }
+    bool get_bool() { return get() != 0; }
+
+    string get_string()
+    {
+      std::size_t n = get_size();
+      string s(m_p, n);
+      m_p += n;
+      return s;
+    }
+
+    void get(std::vector<string>& v)
+    {
+      v.resize(get_size());
+      for (std::vector<string>::iterator it = v.begin(); it != v.end(); ++it)
+        *it = get_string();
+    }
+
+    void get(compiled_template& t)
+    {
+      t.blocks.resize(get_size());
+      for (std::vector<block>::iterator b = t.blocks.begin(); b != t.blocks.end(); ++b)
+      {
+        b->code.resize(get_size());
+        for (std::vector<instruction>::iterator in = b->code.begin();
+          in != b->code.end(); ++in)
+        {
+          boost::uint64_t kind = get();
+          if (kind > instruction::dynamic)
+            fail();
+          in->kind = static_cast<unsigned char>(kind);
+          in->begin = get_index();
+          in->end = get_index();
+          in->line = get_int();
+          in->end_line = get_int();
+          in->landed = get_bool();
+          in->ws_skip = get_bool();
+          in->name = get_uint32();
+          in->value = get_uint32();
+          in->lookups = get_uint32();
+          in->if_index = get_uint32();
+        }
+        b->terminator = get_index();
+        b->terminator_line = get_int();
+        b->terminator_ws_skip = get_bool();
+        b->terminator_lookups = get_uint32();
+        b->safe_points.resize(get_size());
+        for (std::size_t i = 0; i < b->safe_points.size(); ++i)
+        {
+          b->safe_points[i].first = get_index();
+          b->safe_points[i].second = get_index();
+        }
+      }
+
+      t.ifs.resize(get_size());
+      for (std::vector<if_statement>::iterator s = t.ifs.begin(); s != t.ifs.end(); ++s)
+      {
+        s->branches.resize(get_size());
+        for (std::size_t i = 0; i < s->branches.size(); ++i)
+        {
+          s->branches[i].condition = get_index();
+          s->branches[i].body = get_index();
+        }
+        s->line = get_int();
+      }
+
+      t.exprs.resize(get_size());
+      for (std::vector<expr_node>::iterator e = t.exprs.begin(); e != t.exprs.end(); ++e)
+      {
+        e->op = get_string();
+        e->lhs = get_string();
+        e->rhs = get_string();
+        e->left = get_index();
+        e->right = get_index();
+      }
+
+      get(t.strings);
+      t.lookups.resize(get_size());
+      for (std::size_t i = 0; i < t.lookups.size(); ++i)
+        t.lookups[i] = get_uint32();
+    }
+
+  private:
+    const char*  m_p;
+    const char*  m_end;
+    bool         m_ok;
+
+    boost::uint64_t fail()
+    {
+      m_ok = false;
+      m_p = m_end;
+      return 0;
+    }
+  };
+
+//---------------------------------  read_cache_entry  ---------------------------------//
+
+  //  Sets the snippet indexes and templates of src, the contents of the file at path,
+  //  from its entry in directory, if there is an entry for the same contents. Returns
+  //  true if it does.
+
+  bool read_cache_entry(const string& directory, const string& path, source_file& src)
+  {
+    namespace ipc = boost::interprocess;
+    ipc::file_mapping mapping;
+    ipc::mapped_region region;
+    try
+    {
+      ipc::file_mapping(cache_entry_path(directory, path).c_str(), ipc::read_only)
+        .swap(mapping);
+      ipc::mapped_region(mapping, ipc::read_only).swap(region);
+    }
+    catch (const ipc::interprocess_exception&)  // no entry, or an empty one
+    {
+      return false;
+    }
+
+    const char* first = static_cast<const char*>(region.get_address());
+    const char* last = first + region.get_size();
+    cache_reader header(first, last);
+    if (header.get_fixed() != cache_magic || header.get_fixed() != cache_version)
+      return false;
+    boost::uint64_t checksum = header.get_fixed();
+    if (!header.ok() || fnv1a_hash(first + 24, last - first - 24) != checksum)
+      return false;
+
+    cache_reader in(first + 24, last);
+    std::size_t size = static_cast<std::size_t>(src.end - src.begin);
+    if (in.get_string() != path || in.get() != size
+      || in.get_signed() != src.write_time || in.get() != src.hash)
+      return false;
+
+    std::map<string, snippet_index> snippets;
+    for (std::size_t n = in.get_size(); n && in.ok(); --n)
+    {
+      snippet_index& index(snippets[in.get_string()]);
+      for (std::size_t spans = in.get_size(); spans && in.ok(); --spans)
+      {
+        string id(in.get_string());
+        std::size_t begin = in.get_index(), end = in.get_index();
+        int line = in.get_int();
+        if (begin > size || (end != npos && end > size))
+          return false;
+        snippet_span span = { src.begin + begin, end == npos ? 0 : src.begin + end,
+          line };
+        index.insert(snippet_index::value_type(id, span));
+      }
+    }
+
+    std::map<template_key, template_ptr> templates;
+    for (std::size_t n = in.get_size(); n && in.ok(); --n)
+    {
+      string cs(in.get_string()), ce(in.get_string()), ms(in.get_string()),
+        me(in.get_string());
+      std::size_t begin = in.get_index(), end = in.get_index();
+      boost::shared_ptr<compiled_template> t(boost::make_shared<compiled_template>());
+      in.get(*t);
+      templates[template_key(cs, ce, ms, me, begin, end)] = t;
+    }
+
+    if (!in.ok() || !in.at_end())
+      return false;
+    src.snippets.swap(snippets);
+    src.templates.swap(templates);
+    return true;
+  }
+
+//--------------------------------  write_cache_entry  ---------------------------------//
+
+  //  Replaces the entry for the file at path in directory with the snippet indexes and
+  //  templates of src, its contents. The entry is written to a new file that is then
+  //  renamed, so a reader never sees it half written. Failures are ignored, as the
+  //  entry is only an optimization.
+
+  void write_cache_entry(const string& directory, const string& path,
+    const source_file& src)
+  {
+    cache_writer out;
+    out.put(path);
+    out.put(static_cast<boost::uint64_t>(src.end - src.begin));
+    out.put_signed(src.write_time);
+    out.put(src.hash);
+
+    out.put(src.snippets.size());
+    for (std::map<string, snippet_index>::const_iterator it = src.snippets.begin();
+      it != src.snippets.end(); ++it)
+    {
+      out.put(it->first);
+      out.put(it->second.size());
+      for (snippet_index::const_iterator span = it->second.begin();
+        span != it->second.end(); ++span)
+      {
+        out.put(span->first);
+        out.put(static_cast<boost::uint64_t>(span->second.begin - src.begin));
+        out.put(span->second.end ? static_cast<boost::uint64_t>(span->second.end
+          - src.begin) : static_cast<boost::uint64_t>(npos));
+        out.put_signed(span->second.line);
+      }
+    }
+
+    out.put(src.templates.size());
+    for (std::map<template_key, template_ptr>::const_iterator it = src.templates.begin();
+      it != src.templates.end(); ++it)
+    {
+      out.put(std::get<0>(it->first));
+      out.put(std::get<1>(it->first));
+      out.put(std::get<2>(it->first));
+      out.put(std::get<3>(it->first));
+      out.put(std::get<4>(it->first));
+      out.put(std::get<5>(it->first));
+      out.put(*it->second);
+    }
+
+    cache_writer header;
+    header.put_fixed(cache_magic);
+    header.put_fixed(cache_version);
+    header.put_fixed(fnv1a_hash(out.data().data(), out.data().size()));
+
+    namespace fs = boost::filesystem;
+    boost::system::error_code ec;
+    fs::path entry(cache_entry_path(directory, path));
+    fs::path temp(entry.parent_path() / fs::unique_path("%%%%-%%%%-%%%%.tmp", ec));
+    {
+      std::ofstream os(temp.string().c_str(), std::ios_base::out|std::ios_base::binary);
+      os.write(header.data().data(), header.data().size());
+      os.write(out.data().data(), out.data().size());
+      if (!os.flush())
+      {
+        os.close();
+        fs::remove(temp, ec);
+        return;
+      }
+    }
+    fs::rename(temp, entry, ec);
+    if (ec)
+      fs::remove(temp, ec);
+  }
+
+//-----------------------------------  counting_buf  -----------------------------------//
+
+  //  Passes characters through to another stream buffer, counting them.
+
+  class counting_buf : public std::streambuf
+  {
+  public:
+    explicit counting_buf(std::streambuf* target) : m_target(target), m_count(0) {}
+
+    boost::uintmax_t count() const { return m_count; }
+
+  protected:
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+      std::streamsize written = m_target->sputn(s, n);
+      m_count += written;
+      return written;
+    }
+
+    int_type overflow(int_type c)
+    {
+      if (traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+      if (traits_type::eq_int_type(m_target->sputc(traits_type::to_char_type(c)),
+        traits_type::eof()))
+        return traits_type::eof();
+      ++m_count;
+      return c;
+    }
+
+    int sync() { return m_target->pubsync(); }
+
+  private:
+    std::streambuf*   m_target;
+    boost::uintmax_t  m_count;
+  };
+
+//-----------------------------------  json_string  ------------------------------------//
+
+  void json_string(std::ostream& os, const string& s)
+  {
+    os << '"';
+    for (string::const_iterator it = s.begin(); it != s.end(); ++it)
+    {
+      unsigned char c = static_cast<unsigned char>(*it);
+      if (c == '"' || c == '\\')
+        os << '\\' << *it;
+      else if (c < 0x20)
+      {
+        const char* hex = "0123456789abcdef";
+        os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+      }
+      else
+        os << *it;
+    }
+    os << '"';
+  }
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                 file_cache::impl                                     //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+class file_cache::impl
+{
+public:
+  typedef std::map<string, source_ptr> map_type;
+
+  boost::mutex  mutex;  // guards files, and the snippet indexes of the files
+  map_type      files;
+  string        directory;  // of the disk cache, or empty if none
+};
+
+file_cache::file_cache() : m_impl(new impl) {}
+
+file_cache::~file_cache() {}
+
+void file_cache::forget(const string& path)
+{
+  boost::lock_guard<boost::mutex> lock(m_impl->mutex);
+  m_impl->files.erase(path);
+}
+
+void file_cache::persist(const string& directory)
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(directory, ec);
+  boost::lock_guard<boost::mutex> lock(m_impl->mutex);
+  m_impl->directory = directory;
+}
+
+void file_cache::forget_changed()
+{
+  boost::lock_guard<boost::mutex> lock(m_impl->mutex);
+  for (impl::map_type::iterator it = m_impl->files.begin(); it != m_impl->files.end();)
+  {
+    const source_file& src(*it->second);
+    boost::system::error_code ec, size_ec;
+    std::time_t write_time = boost::filesystem::last_write_time(it->first, ec);
+    boost::uintmax_t size = boost::filesystem::file_size(it->first, size_ec);
+
+    // file times may only resolve to seconds, so a file written in the second it was
+    // loaded may have been written again since, unseen
+    if (ec || size_ec || write_time != src.write_time || write_time >= src.load_time
+      || size != static_cast<boost::uintmax_t>(src.end - src.begin))
+      m_impl->files.erase(it++);
+    else
+      ++it;
+  }
+}
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                  trace_log::impl                                     //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+class trace_log::impl
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  struct event
+  {
+    string       name;
+    const char*  category;  // or 0 for the name of the thread
+    long long    ts;        // microseconds since start
+    long long    dur;
+    unsigned     tid;
+  };
+
+  impl() : start(clock::now()), thread_count(0) {}
+
+  const clock::time_point  start;
+  boost::mutex             mutex;  // guards events and thread_count
+  std::vector<event>       events;
+  unsigned                 thread_count;
+};
+
+trace_log::trace_log() : m_impl(new impl) {}
+
+trace_log::~trace_log() {}
+
+void trace_log::write(std::ostream& os) const
+{
+  boost::lock_guard<boost::mutex> lock(m_impl->mutex);
+  os << "{\"traceEvents\":[";
+  for (std::vector<impl::event>::const_iterator it = m_impl->events.begin();
+    it != m_impl->events.end(); ++it)
+  {
+    os << (it == m_impl->events.begin() ? "\n" : ",\n");
+    if (!it->category)
+    {
+      os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << it->tid
+         << ",\"args\":{\"name\":";
+      json_string(os, it->name);
+      os << "}}";
+      continue;
+    }
+    os << "{\"name\":";
+    json_string(os, it->name);
+    os << ",\"cat\":\"" << it->category << "\",\"ph\":\"X\",\"ts\":" << it->ts
+       << ",\"dur\":" << it->dur << ",\"pid\":1,\"tid\":" << it->tid << '}';
+  }
+  os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                processor::impl                                       //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+class processor::impl
+{
+public:
+
+  impl(const options& opts, file_cache::impl& files_)
+    : out(0), verbose(opts.verbose), log_input(opts.log_input),
+      log_output(opts.log_output), log(opts.log), stats(opts.stats),
+      compiled(opts.compile && !opts.stream && !opts.log_input && !opts.log_output),
+      streaming(opts.stream), stream_released(0),
+      prof(opts.stats || opts.trace ? new profile : 0), trace(opts.trace), error_count(0),
+      profiles(opts.profiles), environment(opts.environment), files(files_),
+      context_count(0), resync(0),
+      resync_index(npos), branch_depth(0), in_text(false)
+  {}
+
+  string          in_path;
+  std::ostream*   out;
+  bool            verbose;
+  bool            log_input;
+  bool            log_output;
+  std::ostream*   log;
+  bool            stats;
+  bool            compiled;  // render inputs that are reused from compiled templates
+  bool            streaming;
+  source_ptr      stream_src;       // the input file, if streaming and it is mapped
+  const char*     stream_released;  // the pages of stream_src before this are released
+
+  //  What -stats reports, and -trace records, for the process() call in progress;
+  //  collected only if either was asked for. Times are inclusive of nested contexts.
+  struct profile
+  {
+    typedef std::chrono::steady_clock clock;
+
+    profile() : start(clock::now()), contexts_before(0), allocations_before(0),
+      bytes_before(0), bytes_read(0), max_depth(0), false_branches(0),
+      expansions_reused(0), expansions_made(0), tid(0) {}
+
+    struct totals
+    {
+      totals() : uses(0), time(0) {}
+      unsigned long    uses;
+      clock::duration  time;
+    };
+
+    clock::time_point                 start;
+    unsigned long                     contexts_before;     // context_count at start
+    unsigned long                     allocations_before;  // of scratch at start
+    unsigned long                     bytes_before;        // of scratch at start
+    boost::uintmax_t                  bytes_read;      // of the spans of file contexts
+    std::size_t                       max_depth;       // of the context stack
+    clock::duration                   false_branches;  // time skipping them
+    unsigned long                     expansions_reused;  // memoized ones; see
+    unsigned long                     expansions_made;    // expansion_()
+    std::map<string, totals>          spans;       // key is the path, and snippet id
+    std::map<string, unsigned long>   expansions;  // key is the macro name
+    std::vector<trace_log::impl::event> events;    // if tracing
+    unsigned                          tid;         // if tracing
+  };
+  boost::scoped_ptr<profile>    prof;   // null unless stats or trace
+  boost::shared_ptr<trace_log>  trace;
+
+  int             error_count;
+
+  marker_profile_map profiles;
+  boost::shared_ptr<const macro_map> environment;  // if null, getenv() is used
+
+  file_cache::impl& files;
+
+  std::list<marker_set> marker_sets;  // each set in use, once, shared by the contexts
+
+  struct context
+  {
+    string                  path;
+    int                     line_number;    // at line_pos, or 0 while loading the file
+    const char*             line_pos;       // see line_number_()
+    boost::shared_ptr<const void> content;  // owner of [begin, end), or null if text is
+    string                  text;           // content that is not shared
+    const char*             begin;          // start of content
+    const char*             cur;            // current position
+    const char*             end;            // past-the-end
+    const marker_set*       markers;
+    string                  snippet_id;     // may be empty()
+    unsigned long           serial;         // distinguishes contexts at the same depth
+    bool                    file;           // pushed by new_context()
+    profile::clock::time_point opened;      // if profiling
+  };
+
+  //  A stack of contexts kept in a deque, which never moves them, as their positions
+  //  may point into their own text. Popped contexts are not destroyed, but kept, with
+  //  the capacity of their strings, for later pushes to reuse, so that in the steady
+  //  state a push makes no allocation. A popped context also keeps its content until it
+  //  is reused, so text just advanced over remains valid until the next push.
+
+  class context_stack
+  {
+  public:
+    context_stack() : m_size(0) {}
+
+    //  Returns the new top, holding whatever an earlier use left in it but the
+    //  snippet id, which is cleared.
+    context& push()
+    {
+      if (m_size == m_contexts.size())
+        m_contexts.push_back(context());
+      context& cx(m_contexts[m_size++]);
+      cx.snippet_id.clear();
+      return cx;
+    }
+
+    void pop()                 { --m_size; }
+    context& top()             { return m_contexts[m_size - 1]; }
+    context& bottom()          { return m_contexts[0]; }
+    const context& top() const { return m_contexts[m_size - 1]; }
+    std::size_t size() const   { return m_size; }
+    bool empty() const         { return m_size == 0; }
+    std::size_t capacity() const { return m_contexts.size(); }  // contexts allocated
+
+  private:
+    std::deque<context>  m_contexts;
+    std::size_t          m_size;
+  };
+
+  context_stack state;
+  unsigned long context_count;
+
+  struct resync_point;
+  const resync_point* resync;     // of the detour in progress, if any
+  std::size_t   resync_index;     // the instruction a detour resumes at, if found
+  int           branch_depth;     // if_body_() calls in progress
+
+  macro_table macro;
+
+  //  The output of a call of a macro whose value is text and calls of macros whose
+  //  values are in turn text and calls, and so on, so that later calls can write it
+  //  directly, or push it as the content of a single context, instead of parsing the
+  //  values again. It stays valid while the macros it read keep the values they had.
+  struct expansion
+  {
+    bool                    ok;        // false if the call can't be expanded this way
+    boost::shared_ptr<string> text;    // new for each expansion, as contexts share it
+    string                  pushes;    // the -verbose report of the contexts pushed
+    const marker_set*       markers;
+    std::vector<std::pair<string, macro_table::value_ptr> > reads;  // null if undefined
+    unsigned long           generation;  // of macro when last found valid
+  };
+  std::map<string, expansion> expansions;  // key is the macro name
+  bool in_text;  // a macro call now would be in text, not in a command's arguments
+  dependencies deps;
+
+  arena scratch;  // for the temporaries of a render; see new_scratch_()
+
+  //  An empty string allocated from scratch. It, and any copy of it, must not outlive
+  //  the innermost arena::scope of the caller, nor the render.
+  scratch_string new_scratch_()
+  {
+    return scratch_string(arena_allocator<char>(scratch));
+  }
+
+//-------------------------------------  error  ----------------------------------------//
+
+  void error_at(const string& path, int line_number, const string& msg)
+  {
+    ++error_count;
+    *log << path << '(' << line_number << "): error: " << msg << endl;
+  }
+
+  void error(const string& msg)
+  {
+    if (state.empty() || !state.top().line_number)
+    {
+      ++error_count;
+      *log << in_path << ": error: " << msg << endl;
+    }
+    else
+      error_at(state.top().path, line_number_(), msg);
+  }
+
+//----------------------------------  line_number_  ------------------------------------//
+
+  //  Line numbers are needed only for diagnostics, so rather than count each newline
+  //  as it is advanced over, a context keeps the line number of some earlier position,
+  //  line_pos, and the newlines from there to the position wanted are counted when a
+  //  line number is needed. line_pos then moves up, so no newline is counted twice.
+
+  int line_number_()  // of state.top().cur
+  {
+    set_line_pos_(state.top(), state.top().cur);
+    return state.top().line_number;
+  }
+
+  void set_line_pos_(context& cx, const char* p)  // p must not be before line_pos
+  {
+    BOOST_ASSERT(p >= cx.line_pos);
+    cx.line_number += static_cast<int>(std::count(cx.line_pos, p, '\n'));
+    cx.line_pos = p;
+  }
+
+//------------------------------------  advance  ---------------------------------------//
+
+  void advance(std::ptrdiff_t n=1, bool macro_check=true)
+  {
+    for(; n && state.top().cur != state.top().end; --n)
+    {
+      ++state.top().cur;
+
+      while (state.top().cur == state.top().end && state.size() > 1)
+        pop_();
+
+      if (log_input)
+      {
+        *log << "  Input: ";
+        if (state.top().cur == state.top().end)
+          *log << "end\n";
+        else
+          *log << *state.top().cur << "\n";
+      }
+
+      if (macro_check && state.top().cur != state.top().end && is_macro_start())
+      {
+        macro_call_();
+      }
+    }
+  }
+
+//--------------------------------------  peek  ----------------------------------------//
+
+  //  The current character, or '\0' at the end of the content, so that parsers may look
+  //  at the current character without first checking for the end.
+
+  inline char peek()
+  {
+    return state.top().cur != state.top().end ? *state.top().cur : '\0';
+  }
+
+//---------------------------------  skip_whitespace  ----------------------------------//
+
+  inline void skip_whitespace(bool macro_check=true)
+  {
+    for (; state.top().cur != state.top().end && std::isspace(*state.top().cur);
+      advance(1, macro_check)) {}
+  }
+
+//----------------------------------  is_marker_at  ------------------------------------//
+
+ inline bool is_marker_at(const char* it, const string& marker)
+ {
+   return static_cast<string::size_type>(state.top().end - it) >= marker.size()
+     && std::memcmp(it, marker.c_str(), marker.size()) == 0;
+ }
+
+ //  As is_marker_at(), for one of the markers of the current context
+ inline bool is_context_marker_at(const char* it, const string& marker)
+ {
+   const context& cx(state.top());
+   return cx.markers->single_byte ? single_byte_markers::at(it, cx.end, marker)
+     : any_markers::at(it, cx.end, marker);
+ }
+
+//--------------------------------  is_command_start  ----------------------------------//
+
+ inline bool is_command_start()
+ {
+   return is_context_marker_at(state.top().cur, state.top().markers->command_start);
+ }
+//---------------------------------  is_command_end  -----------------------------------//
+
+ inline bool is_command_end()
+ {
+   return is_context_marker_at(state.top().cur, state.top().markers->command_end);
+ }
+
+ //----------------------------------  is_command  -------------------------------------//
+
+ bool is_command(const char* x)
+ {
+   if (!is_command_start())
+     return false;
+
+   const char* it(state.top().cur + state.top().markers->command_start.size());
+
+   for (; it != state.top().end && std::isspace(*it); ++it) {}
+
+   // compare in place; the command name is the whole run of alphabetic characters
+   for (; *x && it != state.top().end && *it == *x; ++it, ++x) {}
+
+   return !*x && (it == state.top().end || !std::isalpha(*it));
+ }
+
+ //----------------------------------  skip_command  -----------------------------------//
+
+ void skip_command()
+ {
+   advance(state.top().markers->command_start.size(), no_macro_check);
+   for (; state.top().cur != state.top().end && std::isspace(*state.top().cur);
+     advance(1, no_macro_check)) {}
+   for (; state.top().cur != state.top().end && std::isalpha(*state.top().cur);
+     advance(1, no_macro_check)) {}
+ }
+
+//--------------------------------  is_macro_start  -----------------------------------//
+
+ inline bool is_macro_start()
+ {
+   return is_context_marker_at(state.top().cur, state.top().markers->macro_start_);
+ }
+
+//---------------------------------  is_macro_end  ------------------------------------//
+
+ inline bool is_macro_end()
+ {
+   return is_context_marker_at(state.top().cur, state.top().markers->macro_end_);
+ }
+
+ //---------------------------------  next_marker  -------------------------------------//
+
+ //  Returns the position of the first command-start or macro-start marker after cur
+ //  and before limit, or limit if there is none. Characters in [cur, next_marker())
+ //  are plain text.
+
+ const char* next_marker(const char* limit = 0)
+ {
+   const context& cx(state.top());
+   BOOST_ASSERT(cx.cur != cx.end);
+   return cx.markers->next_marker(cx.cur + 1, limit ? limit : cx.end, cx.end);
+ }
+
+ //------------------------------------  skip_to  -------------------------------------//
+
+ //  Equivalent to advance(last - cur), given that [cur, last) contains no macro-start
+ //  other than possibly at cur.
+
+ void skip_to(const char* last)
+ {
+   BOOST_ASSERT(last > state.top().cur);
+   state.top().cur = last - 1;
+   advance();
+ }
+
+ //-----------------------------  advance_if_operator  ---------------------------------//
+                                                         
+ bool advance_if_operator(const string& op, bool macro_check=true)
+ {
+   
+   const char* begin = state.top().cur;
+   const char* p(begin);
+   while (p != state.top().end && isspace(*p))
+     ++p;
+
+   if (!is_marker_at(p, op))
+     return false;
+   advance((p-begin) + op.size(), macro_check);
+   return true;
+ }
+
+//-----------------------------------  load_file  --------------------------------------//
+
+  source_ptr load_file(const string& path)  // null if fails
+  {
+    boost::lock_guard<boost::mutex> lock(files.mutex);
+
+    file_cache::impl::map_type::const_iterator it(files.files.find(path));
+    if (it != files.files.end())
+    {
+      deps.files.insert(path);
+      return it->second;
+    }
+
+    std::ifstream in(path, std::ios_base::in|std::ios_base::binary );
+    if (!in)
+    {
+      error("could not open input file \"" + path + '"');
+      return source_ptr();
+    }
+
+    boost::shared_ptr<source_file> src(boost::make_shared<source_file>());
+    src->begin = src->end = src->data.data();
+    src->hash = 0;
+    src->unsaved = false;
+    src->inputs = 0;
+    boost::system::error_code ec;
+    src->write_time = boost::filesystem::last_write_time(path, ec);
+    if (ec)
+      src->write_time = -1;
+    src->load_time = std::time(0);
+    std::streamoff size = in.seekg(0, std::ios_base::end).tellg();  // -1 if a pipe
+    in.clear();
+
+    if (size > 0)  // empty files can't be mapped
+    {
+      try
+      {
+        namespace ipc = boost::interprocess;
+        ipc::file_mapping(path.c_str(), ipc::read_only).swap(src->mapping);
+        ipc::mapped_region(src->mapping, ipc::read_only).swap(src->region);
+        src->begin = static_cast<const char*>(src->region.get_address());
+        src->end = src->begin + src->region.get_size();
+      }
+      catch (const boost::interprocess::interprocess_exception&)
+      {
+        size = -1;
+      }
+    }
+
+    if (size < 0)  // not mapped
+    {
+      in.seekg(0);
+      in.clear();
+      std::getline(in, src->data, '\0'); // read the whole file
+      src->begin = src->data.data();
+      src->end = src->begin + src->data.size();
+    }
+
+    if (!files.directory.empty() && src->write_time != -1)
+    {
+      src->hash = fnv1a_hash(src->begin, src->end - src->begin);
+      read_cache_entry(files.directory, path, *src);
+    }
+
+    files.files[path] = src;
+    deps.files.insert(path);
+    return src;
+  }
+
+//----------------------------------  save_cache_  -------------------------------------//
+
+  //  Writes the disk cache entry of each file used whose snippet indexes or templates
+  //  have grown since it was loaded or last written.
+
+  void save_cache_()
+  {
+    boost::lock_guard<boost::mutex> lock(files.mutex);
+    if (files.directory.empty())
+      return;
+    for (std::set<string>::const_iterator path = deps.files.begin();
+      path != deps.files.end(); ++path)
+    {
+      file_cache::impl::map_type::const_iterator it(files.files.find(*path));
+      if (it != files.files.end() && it->second->unsaved
+        && it->second->write_time != -1)
+      {
+        write_cache_entry(files.directory, *path, *it->second);
+        it->second->unsaved = false;
+      }
+    }
+  }
+
+//----------------------------------  new_context  -------------------------------------//
+
+  bool new_context(boost::string_ref path)  // true if succeeds
+  {
+    const marker_set* markers = file_markers_(path);
+    state.push().path.assign(path.data(), path.size());
+    state.top().line_number = 0;
+    state.top().serial = ++context_count;
+    source_ptr src(load_file(state.top().path));
+    if (!src)
+    {
+      state.pop();
+      return false;
+    }
+    state.top().line_number = 1;
+    state.top().content = src;
+    state.top().begin = state.top().cur = state.top().line_pos = src->begin;
+    state.top().end = src->end;
+    state.top().markers = markers;
+    state.top().file = true;
+    if (prof)
+      profile_push_();
+    return true;
+  }
+
+//-----------------------------------  markers_  ---------------------------------------//
+
+  const marker_set* markers_(const string& command_start, const string& command_end,
+    const string& macro_start, const string& macro_end)
+  {
+    for (std::list<marker_set>::const_iterator it = marker_sets.begin();
+      it != marker_sets.end(); ++it)
+    {
+      if (it->command_start == command_start && it->command_end == command_end
+        && it->macro_start_ == macro_start && it->macro_end_ == macro_end)
+        return &*it;
+    }
+    bool single_byte = single_byte_markers::fits(command_start, command_end,
+      macro_start, macro_end);
+    marker_set m = { command_start, command_end, macro_start, macro_end, single_byte,
+      single_byte ? boost::shared_ptr<const marker_scanner>()
+        : boost::make_shared<marker_scanner>(command_start, macro_start) };
+    marker_sets.push_back(m);
+    return &marker_sets.back();
+  }
+
+//--------------------------------  file_markers_  -------------------------------------//
+
+  //  The markers of the profile for path's extension, or the default markers.
+
+  const marker_set* file_markers_(boost::string_ref path)
+  {
+    if (!profiles.empty())
+    {
+      std::size_t dot = path.find_last_of("./\\");
+      if (dot != boost::string_ref::npos && path[dot] == '.')
+      {
+        marker_profile_map::const_iterator it(
+          profiles.find(string(path.data() + dot, path.size() - dot)));
+        if (it != profiles.end())
+          return markers_(it->second.command_start, it->second.command_end,
+            it->second.macro_start, it->second.macro_end);
+      }
+    }
+    return markers_(default_command_start, default_command_end, default_macro_start,
+      default_macro_end);
+  }
+
+//--------------------------------  push_context_  -------------------------------------//
+
+  //  Pushes a context for text that is not a file, with the markers of the current
+  //  context, and returns it for the caller to name and fill.
+
+  context& push_context_()
+  {
+    const marker_set* markers = state.top().markers;
+    context& cx(state.push());
+    cx.line_number = 1;
+    cx.serial = ++context_count;
+    cx.markers = markers;
+    cx.file = false;
+    if (prof)
+      profile_push_();
+    return cx;
+  }
+
+//-------------------------------------  pop_  -----------------------------------------//
+
+  void pop_()
+  {
+    if (prof)
+      profile_pop_();
+    state.pop();
+  }
+
+//--------------------------------  push_content  --------------------------------------//
+
+  //  Pushes a context for a copy of content, made in a buffer that the context keeps.
+
+  void push_content(boost::string_ref name, boost::string_ref content)
+  {
+    if (verbose)
+      *log << "pushing " << name << " with content \"" << content << '"' <<endl;
+
+    context& cx(push_context_());
+    cx.path.assign(name.data(), name.size());
+    cx.text.assign(content.data(), content.size());
+    cx.content.reset();
+    cx.begin = cx.cur = cx.line_pos = cx.text.data();
+    cx.end = cx.begin + cx.text.size();
+  }
+
+//----------------------------------  push_call_  --------------------------------------//
+
+  //  Pushes a context for the macro call with the name [first, last), named for the
+  //  call. Its content is the macro's value, shared rather than copied, or if the macro
+  //  isn't defined, the call itself. [first, last) may be in the content of a popped
+  //  context, so it is copied before the content of the pushed context is set.
+
+  void push_call_(const char* first, const char* last, bool with_end,
+    const macro_table::value_ptr* value)
+  {
+    const marker_set& markers(*state.top().markers);
+    context& cx(push_context_());
+    cx.path.assign(markers.macro_start_);
+    cx.path.append(first, last);
+    if (with_end)
+      cx.path += markers.macro_end_;
+
+    if (value)
+    {
+      if (prof)
+        ++prof->expansions[string(first, last)];
+      cx.content = *value;
+      cx.begin = cx.cur = cx.line_pos = (*value)->data();
+      cx.end = cx.begin + (*value)->size();
+    }
+    else
+    {
+      cx.text = cx.path;
+      cx.content.reset();
+      cx.begin = cx.cur = cx.line_pos = cx.text.data();
+      cx.end = cx.begin + cx.text.size();
+    }
+
+    if (verbose)
+    {
+      *log << "pushing " << cx.path << " with content \"";
+      log->write(cx.begin, cx.end - cx.begin);
+      *log << '"' << endl;
+    }
+  }
+
+//--------------------------------  push_expansion_  -----------------------------------//
+
+  //  Pushes a context for the macro call with the name [first, last), as push_call_()
+  //  does, but with the memoized expansion of the call as its content, so the calls in
+  //  the macro's value are not parsed again.
+
+  void push_expansion_(const char* first, const char* last, const expansion& x)
+  {
+    const marker_set& markers(*state.top().markers);
+    context& cx(push_context_());
+    cx.path.assign(markers.macro_start_);
+    cx.path.append(first, last);
+    cx.path += markers.macro_end_;
+    cx.content = x.text;
+    cx.begin = cx.cur = cx.line_pos = x.text->data();
+    cx.end = cx.begin + x.text->size();
+
+    if (prof)
+      for (std::size_t i = 0; i < x.reads.size(); ++i)
+        ++prof->expansions[x.reads[i].first];
+    if (verbose)
+      *log << x.pushes << std::flush;
+  }
+
+//--------------------------------  index_snippets  ------------------------------------//
+
+  //  Adds every "id name=" ... "endid" block of [begin, end) to index, reporting
+  //  duplicate ids and missing endid commands.
+
+  void index_snippets(const char* begin, const char* end, const string& command_start,
+    const string& path, snippet_index& index)
+  {
+    const string id_command(command_start + "id ");
+    const string endid(command_start + "endid");
+    const char* counted = begin;  // newlines before here are counted in line
+    int line = 1;
+
+    for (const char* p = begin;
+      (p = std::search(p, end, id_command.begin(), id_command.end())) != end; )
+    {
+      const char* name_begin = p + id_command.size();
+      const char* name_end = name_begin;
+      for (; name_end != end && (std::isalnum(*name_end) || *name_end == '_');
+        ++name_end) {}
+
+      if (name_end == end || *name_end != '=')  // not an id command
+      {
+        p = name_begin;
+        continue;
+      }
+
+      string id(name_begin, name_end);
+      snippet_span span;
+      span.begin = name_end + 1;
+      line += static_cast<int>(std::count(counted, span.begin, '\n'));
+      counted = span.begin;
+      span.line = line;
+      span.end = std::search(p, end, endid.begin(), endid.end());
+      if (span.end == end)
+      {
+        error_at(path, 1 + static_cast<int>(std::count(begin, p, '\n')),
+          "Could not find " + endid + " for snippet " + id);
+        span.end = 0;
+      }
+
+      if (!index.insert(snippet_index::value_type(id, span)).second)
+        error_at(path, 1 + static_cast<int>(std::count(begin, p, '\n')),
+          "Duplicate snippet " + id);
+
+      p = span.begin;
+    }
+  }
+
+//-----------------------------------  set_id  -----------------------------------------//
+
+  void set_id(boost::string_ref id)
+  {
+    BOOST_ASSERT(state.top().cur == state.top().begin); // precondition check
+    state.top().snippet_id.assign(id.data(), id.size());
+    const string& snippet_id(state.top().snippet_id);
+
+    // the context holds the file, which may have been dropped from the cache since
+    const source_file& src(
+      *boost::static_pointer_cast<const source_file>(state.top().content));
+    boost::lock_guard<boost::mutex> lock(files.mutex);
+    std::map<string, snippet_index>::iterator it(
+      src.snippets.find(state.top().markers->command_start));
+    if (it == src.snippets.end())
+    {
+      it = src.snippets.insert(std::make_pair(state.top().markers->command_start,
+        snippet_index())).first;
+      index_snippets(src.begin, src.end, state.top().markers->command_start,
+        state.top().path, it->second);
+      src.unsaved = true;
+    }
+
+    snippet_index::const_iterator span(it->second.find(snippet_id));
+    if (span == it->second.end())
+    {
+      error("Could not find snippet " + snippet_id + " in " + state.top().path);
+      state.top().begin = state.top().cur = state.top().line_pos = state.top().end;
+      return;
+    }
+    if (!span->second.end)  // reported by index_snippets()
+    {
+      state.top().begin = state.top().cur = state.top().line_pos = state.top().end;
+      return;
+    }
+
+    // set cur to start of snippet, and end to the start of the endid command
+    state.top().begin = state.top().cur = state.top().line_pos = span->second.begin;
+    state.top().line_number = span->second.line;
+    state.top().end = span->second.end;
+  }
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                   EBNF Grammars                                      //
+//                                                                                      //
+//  Notation: ::= for production rules, | for alternatives, {...} for zero or more,     //
+//  [...] for optional                                                                  //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+/*
+
+  --------------------------------------------------------------------------------------
+
+  //  no whitespace permitted between elements
+
+  macro-call    ::= macro-start macro-body
+ 
+  macro-body    ::= macro-end                      // null macro, pushes macro-start
+                  | "(" macro-name ")"  macro-end  // pushes value of macro-name
+                                                   // environmental variable if found,
+                                                   // otherwise pushes macro-call
+                  | macro-name  [macro-end]        // if no macro-end, pushes macro-call
+                                                   // if macro-name defined, pushes
+                                                   // what it is defined as,
+                                                   // otherwise pushes macro-call
+
+  macro-start   ::= "$"                            // replaceable; see docs
+                  
+  macro-end     ::= ";"                            // replaceable; see docs
+
+  macro_name    ::= name_char {name_char}
+  //  In certain file contexts, a command-start is only recognized inside a comment,
+  //  where the comment syntax is specific for that file type.
+
+  --------------------------------------------------------------------------------------
+
+  text          ::= { command-start command command-end
+                    | character
+                    }
+    
+  //  whitespace permitted between elements unless otherwise specified
+
+  command       ::= "def" name string          // name shall not be a keyword
+                  | "include" string           // string is filename
+                  | "snippet" name string      // name is id, string is filename
+                  | "if" if_body
+
+  command-end   ::= ";"                     // replaceable; see docs
+                  | whitespace {whitespace}
+
+  if_body       ::= expression text
+                    {command-start "elif" expression text}
+                    [command-start "else" text]
+                    command-start "endif"
+
+  command-start ::= "$"                         // replaceable; see docs
+
+  string        ::= name
+                  | """{s-char}"""
+
+  s-char        ::= "\"" | "\r" | "\n"
+                  | character                   // " not allowed
+
+  name          ::= name-char{name-char}
+
+  name-char     ::= alnum-char | "_"
+
+  primary_expr  ::= string "==" string
+                  | string "!=" string
+                  | string "<"   string
+                  | string "<=" string
+                  | string ">" string
+                  | string ">=" string
+                  | "(" expression ")"
+  
+  and-expr      ::= primary_expr {"&&" primary_expr}
+                         
+  expression    ::= and-expr {"||" and-expr}
+
+  --------------------------------------------------------------------------------------
+
+  //  snippet grammar
+
+  $id snippet=
+
+  //  whitespace permitted only in {character}
+
+  snippet    ::= command_start "id " name "=" {character} command-start "endid" $endid
+
+*/
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                           Recursive Decent Parsers                                   //
+//     functions with names ending in underscore correspond to grammar productions      //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+//--------------------------------------------------------------------------------------//
+//                                 macro-call parser                                    //
+//--------------------------------------------------------------------------------------//
+
+
+//-----------------------------------  macro_call  -------------------------------------//
+
+void macro_call_()
+{
+  arena::scope temporaries(scratch);
+  const bool text = in_text;  // and the calls in the name are not
+  in_text = false;
+  advance(state.top().markers->macro_start_.size(), no_macro_check);
+
+  // null macro
+  if (is_macro_end())
+  {
+    advance(state.top().markers->macro_end_.size(), no_macro_check);
+    push_content("null macro", state.top().markers->macro_start_);
+  }
+
+  // enviromental variable reference
+  else if (state.top().cur != state.top().end && *state.top().cur == '(')
+  {
+    advance(1, no_macro_check);
+    scratch_string name(macro_name());
+    const char* p = getenv_(name.c_str());
+    deps.environment.insert(string(name.begin(), name.end()));
+    if (state.top().cur != state.top().end && *state.top().cur == ')')
+      advance(1, no_macro_check);
+    else
+      error("missing closing )");
+    if (is_macro_end())
+      advance(state.top().markers->macro_end_.size(), no_macro_check);
+    else
+      error("missing " + state.top().markers->macro_end_);
+
+    const marker_set& m(*state.top().markers);
+    scratch_string call(new_scratch_());
+    call.append(m.macro_start_.data(), m.macro_start_.size()).append(1, '(')
+      .append(name).append(1, ')').append(m.macro_end_.data(), m.macro_end_.size());
+    if (p)
+      push_content(call, p);
+    else
+    {
+      error("not found: " + string(call.begin(), call.end()));
+      push_content(call, call);
+    }
+  }
+
+  // macro-name [macro-end]
+  else
+  {
+    const char* first;
+    const char* last;
+    scratch_string name(new_scratch_());
+    if (!macro_name_span(first, last))
+    {
+      name = macro_name();
+      first = name.data();
+      last = first + name.size();
+    }
+
+    if (is_macro_end())
+    {
+      advance(state.top().markers->macro_end_.size(), no_macro_check);
+
+      // if the macro is not found, push advanced over characters. A call in text may
+      // push its memoized expansion instead of its value; in a command's arguments,
+      // the contexts of the nested calls are kept, as a diagnostic names the innermost.
+      const macro_table::value_ptr* value = macro.find(first, last - first);
+      if (value && text && !log_input && !is_plain_(**value, false))
+      {
+        const expansion& x(expansion_(string(first, last)));
+        if (x.ok)
+        {
+          push_expansion_(first, last, x);
+          return;
+        }
+      }
+      push_call_(first, last, true, value);
+    }
+    else  // no macro-end so push advanced over characters
+      push_call_(first, last, false, 0);
+  }
+}
+
+//---------------------------------  macro_name_span  ----------------------------------//
+
+//  Advances over a macro name that lies wholly in the current context, setting
+//  [first, last) to it, if advancing over it a character at a time, as macro_name()
+//  does, would neither leave the context nor call a macro. Otherwise returns false
+//  without advancing.
+
+bool macro_name_span(const char*& first, const char*& last)
+{
+  context& cx(state.top());
+  const char* p = cx.cur;
+  while (p != cx.end && (std::isalnum(*p) || *p == '_'))
+    ++p;
+
+  if (log_input
+    || std::isalnum(cx.markers->macro_start_[0]) || cx.markers->macro_start_[0] == '_'
+    || (p == cx.end ? state.size() > 1
+      : is_context_marker_at(p, cx.markers->macro_start_)))
+    return false;
+
+  first = cx.cur;
+  last = cx.cur = p;
+  return true;
+}
+
+//------------------------------------  macro_name  ------------------------------------//
+
+scratch_string macro_name()
+{
+  scratch_string name(new_scratch_());
+
+  while (state.top().cur != state.top().end
+    && (std::isalnum(*state.top().cur) || *state.top().cur == '_'))
+  {
+    name += *state.top().cur;
+    advance();
+  }
+
+  return name;
+}
+
+//--------------------------------------------------------------------------------------//
+//                                    text parser                                       //
+//--------------------------------------------------------------------------------------//
+
+//-------------------------------------  name_  ----------------------------------------//
+
+  scratch_string name_()
+  {
+    skip_whitespace(); 
+
+    scratch_string s(new_scratch_());
+
+    // store string
+    for (; state.top().cur != state.top().end &&
+      (std::isalnum(*state.top().cur) || *state.top().cur == '_');
+      advance())
+    {
+      s += *state.top().cur;
+    }
+
+    return s;
+  }
+
+//---------------------------------  simple_string_  -----------------------------------//
+
+  inline scratch_string simple_string_()
+  {
+    return name_();
+  }
+
+//-----------------------------------  string_  ----------------------------------------//
+
+  scratch_string string_()
+  {
+    skip_whitespace(); 
+
+    if (peek() != '"')
+      return simple_string_();
+
+    int starting_line = line_number_();
+
+    advance();  // bypass the '"'
+
+    scratch_string s(new_scratch_());
+
+    // store string
+    for (; state.top().cur != state.top().end && *state.top().cur != '"'; advance())
+    {
+      s += *state.top().cur;
+    }
+
+    // maintain the state.top().cur invariant
+    if (peek() == '"')
+      advance();
+    else
+    {
+      error("no closing quote for string that began on line "
+        + lexical_cast<string>(starting_line));
+    }
+
+    return s;
+  }
+
+//----------------------------------  primary_expr_  -----------------------------------//
+
+  bool primary_expr_()  // true if evaluates to true
+  {
+    
+    if (advance_if_operator("("))
+    {
+      bool expr = expression_();
+      skip_whitespace();
+      if (peek() == ')')
+        advance();
+      else
+        error("syntax error: expected ')' to close expression");
+      return expr;
+    }
+
+    scratch_string lhs(string_());
+    skip_whitespace();
+    scratch_string operation(new_scratch_());
+    if (std::strchr("=!<>", peek()))
+    {
+      operation += peek();
+      advance();
+    }
+    if (peek() == '=')
+    {
+      operation += '=';
+      advance();
+    }
+
+    scratch_string rhs(string_());
+
+    if (operation == "==")
+      return lhs == rhs;
+    else if (operation == "!=")
+      return lhs != rhs;
+    else if (operation == "<")
+      return lhs < rhs;
+    else if (operation == "<=")
+      return lhs <= rhs;
+    else if (operation == ">")
+      return lhs > rhs;
+    else if (operation == ">=")
+      return lhs >= rhs;
+    else
+      error("expected a relational operator instead of \""
+        + string(operation.begin(), operation.end()) + "\"");
+    return false;
+  }
+
+//-----------------------------------  and_expr_  --------------------------------------//
+
+  //  Once the result is known, the remaining operands are skipped as in a false
+  //  branch, so the macros in them are not expanded.
+
+  bool and_expr_()  // true if evaluates to true
+  {
+    bool result = primary_expr_();
+  
+    for (; advance_if_operator("&&", result);)
+    {
+      if (result)
+        result = primary_expr_();
+      else
+        skip_primary_expr_();
+    }
+    return result;
+  }
+
+//----------------------------------  expression_  -------------------------------------//
+
+  bool expression_()  // true if evaluates to true
+  {
+    bool result = and_expr_();
+  
+    for (; advance_if_operator("||", !result);)
+    {
+      if (!result)
+        result = and_expr_();
+      else
+        skip_and_expr_();
+    }
+    return result;
+  }
+
+//-----------------------------------  if_body_  ---------------------------------------//
+
+  void if_body_(bool side_effects)
+  {
+    int if_line_n = line_number_();
+    ++branch_depth;
+
+    // expression text
+    bool true_done = expression_();
+    text_(true_done && side_effects);
+
+    if_tail_(true_done, side_effects, if_line_n);
+    --branch_depth;
+  }
+
+  //  The remainder of an if_body, from the end of the text of a branch
+
+  void if_tail_(bool true_done, bool side_effects, int if_line_n)
+  {
+    // {command-start "elif" command-end expression text}
+    while (is_command("elif"))
+    {
+      skip_command();
+      text_((!true_done && (true_done = expression_())) && side_effects);
+    }
+
+    // [command-start "else" command-end text]
+    if (is_command("else"))
+    {
+      skip_command();
+      text_(!true_done && side_effects);
+    }
+
+    // command-start "endif"
+    if (is_command("endif"))
+    {
+       advance(state.top().markers->command_start.size(), no_macro_check);
+       advance(sizeof("endif")-1, no_macro_check);
+    }
+    else
+      error("expected \"endif\" to close \"if\" begun on line "
+        + lexical_cast<string>(if_line_n));
+  }
+
+//-----------------------------------  command_  ---------------------------------------//
+
+  void command_(bool side_effects) 
+  {
+    arena::scope temporaries(scratch);
+    advance(state.top().markers->command_start.size(), no_macro_check);
+    scratch_string command(name_());
+
+    // def[ine] macro command
+    if (command == "def")
+    {
+      scratch_string name(name_());
+      scratch_string value(string_());
+      if (side_effects)
+        macro.define(name, value);
+    }
+
+    // include command
+    else if (command == "include")
+    {
+      scratch_string path(string_());
+      if (side_effects)
+      {
+        new_context(path);
+        text_();
+      }
+    }
+
+    // snippet command
+    else if (command == "snippet")
+    {
+      scratch_string id(name_());
+      scratch_string path(string_());
+      if (side_effects)
+      {
+        if (new_context(path))
+        {
+          set_id(id);
+          text_();
+        }
+      }
+    }
+
+    // if command
+    else if (command == "if")
+      if_body_(side_effects);
+
+    // not a command
+    else
+      error(string(command.begin(), command.end()) + " is not a valid command");
+  }
+
+//--------------------------------------------------------------------------------------//
+//                                     skip mode                                        //
+//                                                                                      //
+//  Text of a false if branch is scanned only for the commands that affect nesting,     //
+//  and for the arguments of other commands, so that a quoted string cannot end the     //
+//  branch early. Nothing is output, no macro is expanded, and no context is pushed.    //
+//--------------------------------------------------------------------------------------//
+
+//---------------------------------  skip_string_  -------------------------------------//
+
+  void skip_string_()
+  {
+    skip_whitespace(no_macro_check);
+
+    if (state.top().cur != state.top().end && *state.top().cur == '"')
+    {
+      advance(1, no_macro_check);
+      for (; state.top().cur != state.top().end && *state.top().cur != '"';
+        advance(1, no_macro_check)) {}
+      if (state.top().cur != state.top().end)
+        advance(1, no_macro_check);
+      return;
+    }
+
+    // name, possibly built up from macro calls
+    while (state.top().cur != state.top().end)
+    {
+      if (std::isalnum(*state.top().cur) || *state.top().cur == '_')
+        advance(1, no_macro_check);
+      else if (is_macro_start())
+      {
+        advance(state.top().markers->macro_start_.size(), no_macro_check);
+        if (state.top().cur != state.top().end && *state.top().cur == '(')
+          advance(1, no_macro_check);
+        for (; state.top().cur != state.top().end
+          && (std::isalnum(*state.top().cur) || *state.top().cur == '_');
+          advance(1, no_macro_check)) {}
+        if (state.top().cur != state.top().end && *state.top().cur == ')')
+          advance(1, no_macro_check);
+        if (state.top().cur != state.top().end && is_macro_end())
+          advance(state.top().markers->macro_end_.size(), no_macro_check);
+      }
+      else
+        break;
+    }
+  }
+
+//-----------------------------  skip_if_operator  -------------------------------------//
+
+  //  As advance_if_operator(), leaving the whitespace before anything else, so that
+  //  an operand skipped by a short-circuit ends where an evaluated one would.
+
+  bool skip_if_operator(const char* op)
+  {
+    const char* p = state.top().cur;
+    while (p != state.top().end && std::isspace(*p))
+      ++p;
+    std::size_t n = std::strlen(op);
+    if (static_cast<std::size_t>(state.top().end - p) < n || std::memcmp(p, op, n) != 0)
+      return false;
+    advance((p - state.top().cur) + n, no_macro_check);
+    return true;
+  }
+
+//---------------------------------  skip_primary_expr_  -------------------------------//
+
+  //  Unlike the text of a false branch, a skipped operand is followed by whatever an
+  //  evaluated one is, so a macro that starts right after its closing '"' or ')' is
+  //  expanded, as the advance() past that character would expand it.
+
+  void skip_primary_expr_()
+  {
+    if (skip_if_operator("("))
+    {
+      skip_expression_();
+      if (skip_if_operator(")"))
+        macro_check_();
+      return;
+    }
+
+    skip_operand_();
+    skip_whitespace(no_macro_check);
+    for (int i = 0; i < 2 && state.top().cur != state.top().end
+      && std::strchr("=!<>", *state.top().cur); ++i)
+      advance(1, no_macro_check);
+    skip_operand_();
+  }
+
+  void skip_operand_()
+  {
+    skip_whitespace(no_macro_check);
+    bool quoted = peek() == '"';
+    skip_string_();
+    if (quoted)
+      macro_check_();
+  }
+
+  void macro_check_()  // as advance() does after each character
+  {
+    if (state.top().cur != state.top().end && is_macro_start())
+      macro_call_();
+  }
+
+//-----------------------------------  skip_expression_  -------------------------------//
+
+  void skip_and_expr_()
+  {
+    skip_primary_expr_();
+    while (skip_if_operator("&&"))
+      skip_primary_expr_();
+  }
+
+  void skip_expression_()
+  {
+    skip_and_expr_();
+    while (skip_if_operator("||"))
+      skip_and_expr_();
+  }
+
+//-----------------------------------  skip_if_body_  ----------------------------------//
+
+  void skip_if_body_()
+  {
+    int if_line_n = line_number_();
+
+    skip_expression_();
+    skip_text_();
+
+    while (is_command("elif"))
+    {
+      skip_command();
+      skip_expression_();
+      skip_text_();
+    }
+
+    if (is_command("else"))
+    {
+      skip_command();
+      skip_text_();
+    }
+
+    if (is_command("endif"))
+    {
+       advance(state.top().markers->command_start.size(), no_macro_check);
+       advance(sizeof("endif")-1, no_macro_check);
+    }
+    else
+      error("expected \"endif\" to close \"if\" begun on line "
+        + lexical_cast<string>(if_line_n));
+  }
+
+//-----------------------------------  skip_text_  -------------------------------------//
+
+  //  Postcondition: state.top().cur is at an elif, else, or endif command that is not
+  //  nested in an inner if, or at the end of the input.
+
+  void skip_text_()
+  {
+    for (;;)
+    {
+      context& cx(state.top());
+
+      // find the next command-start
+      const string& cs(cx.markers->command_start);
+      cx.cur = cx.markers->single_byte
+        ? find_marker<single_byte_markers>(cx.cur, cx.end, cs, cs)
+        : find_marker<any_markers>(cx.cur, cx.end, cs, cs);
+
+      if (cx.cur == cx.end)
+      {
+        if (state.size() == 1)
+          return;
+        pop_();
+        continue;
+      }
+
+      if (is_command("elif") || is_command("else") || is_command("endif"))
+        return;
+
+      if (is_command("if"))
+      {
+        skip_command();
+        skip_if_body_();
+      }
+      else if (is_command("def") || is_command("snippet"))
+      {
+        skip_command();
+        skip_string_();   // name
+        skip_string_();
+      }
+      else if (is_command("include"))
+      {
+        skip_command();
+        skip_string_();
+      }
+      else  // not a command, so only the command-start is skipped
+      {
+        advance(cx.markers->command_start.size(), no_macro_check);
+        continue;
+      }
+
+      if (state.top().cur != state.top().end && is_command_end())
+        advance(state.top().markers->command_end.size(), no_macro_check);
+      else
+        skip_whitespace(no_macro_check);
+    }
+  }
+
+//------------------------------------- text_  -----------------------------------------//
+
+  void text_(bool side_effects = true)
+  {
+    BOOST_ASSERT(!state.empty());  // failure indicates program logic error
+
+    if (!side_effects)  // text of a false branch
+    {
+      if (!prof)
+        skip_text_();
+      else
+      {
+        profile::clock::time_point start(profile::clock::now());
+        skip_text_();
+        prof->false_branches += profile::clock::now() - start;
+      }
+      return;
+    }
+
+    //if (verbose)
+    //  *log << "Processing " << state.top().path << "...\n";
+
+    if (text_loop_() == loop_end)
+    {
+      BOOST_ASSERT(state.size() == 1);  // failure indicates program logic error
+    }
+
+    //if (verbose)
+    //  *log << "  " << state.top().path << " complete\n";
+  }
+
+//-----------------------------------  text_loop_  -------------------------------------//
+
+  //  The loop of text_(). During a detour from a compiled block, the loop also stops
+  //  where the block can take over again: on a safe point of the block, in the block's
+  //  context, and not within an if nested in the detour. That may happen in the text_()
+  //  of an $include or $snippet begun by the detour, once it has gone on past the end of
+  //  the included file, since what is left of that text_() and of its callers is then
+  //  the same as what is left of the detour. The detour itself also stops when the
+  //  block's context has been left.
+
+  enum loop_result { loop_end, loop_terminator, loop_resync, loop_left };
+
+  struct resync_point
+  {
+    const block*   code;
+    std::size_t    depth;   // state.size() with the block's context on top
+    unsigned long  serial;  // of that context
+    const char*    origin;  // the start of the file
+  };
+
+  loop_result text_loop_(bool detour = false)
+  {
+    for(; state.top().cur != state.top().end;)
+    {
+      if (resync && state.size() <= resync->depth)
+      {
+        if (state.size() < resync->depth || state.top().serial != resync->serial)
+        {
+          if (detour)
+            return loop_left;
+        }
+        else if (branch_depth == 0 && find_safe_point_())
+          return loop_resync;
+      }
+
+      if (is_command_start())
+      { 
+        // text_ is terminated by an elif, else, or endif
+        if (is_command("elif")
+          || is_command("else")
+          || is_command("endif"))
+          return loop_terminator;
+
+        command_(true);
+        if (resync_index != npos)  // found by the text_() of an $include or $snippet
+          return loop_resync;
+        if (state.top().cur == state.top().end)
+          break;
+        if (is_command_end())
+          advance(state.top().markers->command_end.size(), false);
+        else
+          skip_whitespace();
+     }
+      else  // run of characters up to the next marker
+      {
+        const char* first(state.top().cur);
+        const char* last(log_input ? first + 1
+          : next_marker(streaming && static_cast<std::size_t>(state.top().end - first)
+              > stream_window ? first + stream_window : 0));
+
+        out->write(first, last - first);
+
+        if (log_output)
+          for (const char* it = first; it != last; ++it)
+            *log << "  Output: " << *it << endl;
+
+        in_text = true;
+        skip_to(last);
+        in_text = false;
+      }
+
+      if (stream_src)
+        release_behind_();
+    }
+    return loop_end;
+  }
+
+//--------------------------------  release_behind_  -----------------------------------//
+
+  //  Once a window's worth of the input file is behind the current position, releases
+  //  its pages, so the memory the file takes stays bounded however large it is. Text
+  //  once passed is not read again, and would be paged back in from the file if it were.
+  //  Pages are released only where madvise() is available; an input that isn't mapped
+  //  was read whole by load_file(), and nothing bounds it.
+
+  void release_behind_()
+  {
+    const char* cur = state.bottom().cur;
+    if (static_cast<std::size_t>(cur - stream_released) < stream_window)
+      return;
+    std::size_t page = boost::interprocess::mapped_region::get_page_size();
+    const char* base = static_cast<const char*>(stream_src->region.get_address());
+    const char* to = base + (cur - base) / page * page;
+    if (state.bottom().line_pos < to)  // so a line number won't need released pages
+      set_line_pos_(state.bottom(), to);
+#if defined(__unix__) || defined(__APPLE__)
+    ::madvise(const_cast<char*>(stream_released), to - stream_released, MADV_DONTNEED);
+#endif
+    stream_released = to;
+  }
+
+//--------------------------------  start_streaming_  ----------------------------------//
+
+  void start_streaming_()
+  {
+    source_ptr src(boost::static_pointer_cast<const source_file>(state.top().content));
+    if (!src->region.get_size())  // not mapped, so already wholly in memory
+      return;
+    stream_src = src;
+    stream_released = static_cast<const char*>(src->region.get_address());
+#if defined(__unix__) || defined(__APPLE__)
+    ::madvise(const_cast<char*>(stream_released), src->region.get_size(),
+      MADV_SEQUENTIAL);
+#endif
+  }
+
+//----------------------------------  begin_profile_  ----------------------------------//
+
+  void begin_profile_()
+  {
+    prof.reset(new profile);
+    prof->contexts_before = context_count;
+    prof->allocations_before = scratch.allocations();
+    prof->bytes_before = scratch.bytes();
+    if (trace)
+    {
+      boost::lock_guard<boost::mutex> lock(trace->m_impl->mutex);
+      prof->tid = ++trace->m_impl->thread_count;
+      trace_log::impl::event e = { in_path, 0, 0, 0, prof->tid };
+      trace->m_impl->events.push_back(e);
+    }
+  }
+
+//-----------------------------------  end_profile_  -----------------------------------//
+
+  void end_profile_(boost::uintmax_t bytes_written)
+  {
+    if (stats)
+      stats_report_(bytes_written);
+    if (trace)
+    {
+      boost::lock_guard<boost::mutex> lock(trace->m_impl->mutex);
+      trace->m_impl->events.insert(trace->m_impl->events.end(), prof->events.begin(),
+        prof->events.end());
+    }
+  }
+
+//----------------------------------  profile_push_  -----------------------------------//
+
+  //  Called for each context pushed, once it is on top of the stack.
+
+  void profile_push_()
+  {
+    state.top().opened = profile::clock::now();
+    if (state.size() > prof->max_depth)
+      prof->max_depth = state.size();
+  }
+
+//-----------------------------------  profile_pop_  -----------------------------------//
+
+  //  Called for each context about to be popped.
+
+  void profile_pop_()
+  {
+    const context& cx(state.top());
+    profile::clock::time_point now(profile::clock::now());
+    if (!cx.file)
+    {
+      if (trace)
+        trace_event_(cx.path, "macro", cx.opened, now);
+      return;
+    }
+
+    string name(cx.path);
+    if (!cx.snippet_id.empty())
+      name += '#' + cx.snippet_id;
+    profile::totals& totals(prof->spans[name]);
+    ++totals.uses;
+    totals.time += now - cx.opened;
+    prof->bytes_read += cx.end - cx.begin;
+    if (trace)
+      trace_event_(name, cx.snippet_id.empty() ? "file" : "snippet", cx.opened, now);
+  }
+
+//--------------------------------  profile_expansion_  --------------------------------//
+
+  //  Called for each macro call a compiled template writes directly, begun at start,
+  //  with the expansion written, if it was not just the value.
+
+  void profile_expansion_(const string& name, profile::clock::time_point start,
+    const expansion* x)
+  {
+    if (!x)
+      ++prof->expansions[name];
+    else
+      for (std::size_t i = 0; i < x->reads.size(); ++i)
+        ++prof->expansions[x->reads[i].first];
+    if (trace)
+    {
+      const marker_set& m(*state.top().markers);
+      trace_event_(m.macro_start_ + name + m.macro_end_, "macro", start,
+        profile::clock::now());
+    }
+  }
+
+//-----------------------------------  trace_event_  -----------------------------------//
+
+  void trace_event_(const string& name, const char* category,
+    profile::clock::time_point first, profile::clock::time_point last)
+  {
+    typedef std::chrono::microseconds us;
+    trace_log::impl::event e = { name, category,
+      std::chrono::duration_cast<us>(first - trace->m_impl->start).count(),
+      std::chrono::duration_cast<us>(last - first).count(), prof->tid };
+    prof->events.push_back(e);
+  }
+
+//----------------------------------  stats_report_  -----------------------------------//
+
+  void stats_report_(boost::uintmax_t bytes_written)
+  {
+    typedef std::chrono::duration<double, std::milli> ms;
+    const std::size_t top = 10;  // entries listed in each ranking
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2);
+
+    os << in_path << ": stats:\n"
+       << "  time: " << ms(profile::clock::now() - prof->start).count() << " ms\n"
+       << "  bytes: " << prof->bytes_read << " read, " << bytes_written << " written\n"
+       << "  contexts: " << context_count - prof->contexts_before << " pushed, "
+       << state.capacity() << " allocated, " << prof->max_depth << " deep at most\n"
+       << "  false branches: " << ms(prof->false_branches).count() << " ms\n"
+       << "  scratch: " << scratch.allocations() - prof->allocations_before
+       << " allocations, " << scratch.bytes() - prof->bytes_before << " bytes, "
+       << scratch.blocks() << " blocks allocated\n"
+       << "  memoized expansions: " << prof->expansions_reused << " reused, "
+       << prof->expansions_made << " made\n";
+
+    //  each ranking lists the top entries, ties in name order
+    typedef std::map<string, profile::totals>::const_iterator span_iterator;
+    std::vector<span_iterator> spans;
+    for (span_iterator it = prof->spans.begin(); it != prof->spans.end(); ++it)
+      spans.push_back(it);
+    std::stable_sort(spans.begin(), spans.end(), [](span_iterator a, span_iterator b)
+      { return a->second.time > b->second.time; });
+    os << "  slowest files and snippets (uses, ms):\n";
+    for (std::size_t i = 0; i < spans.size() && i < top; ++i)
+      os << "    " << std::setw(8) << spans[i]->second.uses << std::setw(10)
+         << ms(spans[i]->second.time).count() << "  " << spans[i]->first << '\n';
+
+    typedef std::map<string, unsigned long>::const_iterator macro_iterator;
+    std::vector<macro_iterator> hottest;
+    for (macro_iterator it = prof->expansions.begin(); it != prof->expansions.end();
+      ++it)
+      hottest.push_back(it);
+    std::stable_sort(hottest.begin(), hottest.end(),
+      [](macro_iterator a, macro_iterator b) { return a->second > b->second; });
+    os << "  hottest macros (expansions):\n";
+    for (std::size_t i = 0; i < hottest.size() && i < top; ++i)
+      os << "    " << std::setw(8) << hottest[i]->second << "  " << hottest[i]->first
+         << '\n';
+
+    *log << os.str();
+  }
+
+//--------------------------------------------------------------------------------------//
+//                                  compiled templates                                  //
+//                                                                                      //
+//  render_file_() renders the context on top of the stack from its compiled template.  //
+//  An instruction the template can't render by itself starts a detour: text_loop_()    //
+//  takes over, from the state the text parser would be in, until it reaches a safe     //
+//  point of the block, where the compiled instructions continue. Each result leaves    //
+//  the context stack exactly as the text parser would.                                 //
+//--------------------------------------------------------------------------------------//
+
+  enum render_result
+  {
+    rendered,    // to the end of the block, which is left as the text parser would
+    misaligned,  // the text of the block ended elsewhere; the caller continues
+    left_file    // the detour left the file, in the including context
+  };
+
+  enum detour_kind { no_detour, plain, landing, landing_ws, after_command };
+
+//----------------------------------  render_file_  ------------------------------------//
+
+  //  Renders the content of state.top() from its cur to its end, as text_() does, and
+  //  pops the context if it is rendered to the end.
+
+  render_result render_file_()
+  {
+    const context& cx(state.top());
+    if (cx.cur == cx.end)
+      return misaligned;
+
+    boost::shared_ptr<const source_file> src(
+      boost::static_pointer_cast<const source_file>(cx.content));
+    template_ptr t(compiled_template_(*src, cx));
+
+    resync_point rs = { 0, state.size(), cx.serial, src->begin };
+    render_result result = render_block_(*t, 0, rs);
+    if (result != rendered)
+      return result;
+    if (state.top().cur != state.top().end)  // a stray elif, else, or endif
+      return misaligned;
+    if (state.size() > 1)
+      pop_();
+    return rendered;
+  }
+
+//--------------------------------  reused_input_  -------------------------------------//
+
+  //  Called once per process() call with the input on top of the stack. True if the
+  //  input has been the input of an earlier call sharing the file cache, as in a batch,
+  //  a set of configurations, a server, or -watch, or if the file cache is persisted for
+  //  later runs, or if the input's template is already cached. Compiling costs several
+  //  times what interpreting once does, so the template of an input is compiled only
+  //  when it will be reused, and then renders each later use.
+
+  bool reused_input_()
+  {
+    const context& cx(state.top());
+    const source_file& src(*boost::static_pointer_cast<const source_file>(cx.content));
+    boost::lock_guard<boost::mutex> lock(files.mutex);
+    return ++src.inputs > 1 || !files.directory.empty()
+      || src.templates.count(template_key_(src, cx));
+  }
+
+//-----------------------------  compiled_template_  -----------------------------------//
+
+  static template_key template_key_(const source_file& src, const context& cx)
+  {
+    const marker_set& m(*cx.markers);
+    return template_key(m.command_start, m.command_end, m.macro_start_, m.macro_end_,
+      cx.cur - src.begin, cx.end - src.begin);
+  }
+
+  template_ptr compiled_template_(const source_file& src, const context& cx)
+  {
+    template_key key(template_key_(src, cx));
+    {
+      boost::lock_guard<boost::mutex> lock(files.mutex);
+      std::map<template_key, template_ptr>::const_iterator it(src.templates.find(key));
+      if (it != src.templates.end())
+        return it->second;
+    }
+
+    // compile without the lock; if another thread compiles the same span first, its
+    // template is used
+    boost::shared_ptr<compiled_template> t(boost::make_shared<compiled_template>());
+    compile_template(src.begin, cx.cur, cx.end, *cx.markers, *t);
+
+    boost::lock_guard<boost::mutex> lock(files.mutex);
+    std::pair<std::map<template_key, template_ptr>::iterator, bool> result(
+      src.templates.insert(std::make_pair(key, t)));
+    if (result.second)
+      src.unsaved = true;
+    return result.first->second;
+  }
+
+//----------------------------------  render_block_  -----------------------------------//
+
+  render_result render_block_(const compiled_template& t, std::size_t bi,
+    resync_point rs)
+  {
+    const block& b(t.blocks[bi]);
+    rs.code = &b;
+
+    for (std::size_t i = 0;;)
+    {
+      detour_kind detour;
+      if (i < b.code.size())
+      {
+        if ((detour = render_instruction_(t, b.code[i], rs)) == no_detour)
+        {
+          ++i;
+          continue;
+        }
+      }
+      else
+      {
+        move_to_(rs.origin + b.terminator, b.terminator_line);
+        if (!defines_any_(t, b.terminator_lookups))
+          return rendered;
+        detour = b.terminator_ws_skip ? landing_ws : landing;
+      }
+
+      switch (detour_(detour, rs))
+      {
+      case loop_resync:
+        i = resync_index;
+        resync_index = npos;
+        continue;
+      case loop_left:
+        if (bi == 0)
+          return left_file;
+        text_loop_();  // the text_() of the if branch goes on in the including context
+        return misaligned;
+      default:
+        return state.size() == rs.depth && state.top().serial == rs.serial
+          && state.top().cur == rs.origin + b.terminator ? rendered : misaligned;
+      }
+    }
+  }
+
+//-------------------------------  render_instruction_  --------------------------------//
+
+  detour_kind render_instruction_(const compiled_template& t, const instruction& in,
+    const resync_point& rs)
+  {
+    switch (in.kind)
+    {
+    case instruction::text:
+      out->write(rs.origin + in.begin, in.end - in.begin);
+      break;
+
+    case instruction::macro:
+      {
+        const string& name(t.strings[in.name]);
+        const macro_table::value_ptr* value = macro.find(name);
+        if (!value)
+          return start_detour_(in, rs);
+        profile::clock::time_point start;
+        if (prof)
+          start = profile::clock::now();
+        if (!is_plain_(**value, in.ws_skip))
+        {
+          const expansion& x(expansion_(name));
+          if (!x.ok
+            || (in.ws_skip && std::isspace(static_cast<unsigned char>((*x.text)[0]))))
+            return start_detour_(in, rs);
+          if (verbose)
+            *log << x.pushes << std::flush;
+          out->write(x.text->data(), x.text->size());
+          if (prof)
+            profile_expansion_(name, start, &x);
+          break;
+        }
+        if (verbose)
+          *log << "pushing " << state.top().markers->macro_start_ << name
+               << state.top().markers->macro_end_ << " with content \"" << **value
+               << '"' << endl;
+        out->write((*value)->data(), (*value)->size());
+        if (prof)
+          profile_expansion_(name, start, 0);
+      }
+      break;
+
+    case instruction::def:
+      if (defines_any_(t, in.lookups))
+        return start_detour_(in, rs);
+      macro.define(t.strings[in.name], t.strings[in.value]);
+      break;
+
+    case instruction::include:
+    case instruction::snippet:
+      if (defines_any_(t, in.lookups))
+        return start_detour_(in, rs);
+      move_to_(rs.origin + in.end, in.end_line);
+      if (!new_context(t.strings[in.value]))
+        return in.kind == instruction::include ? no_detour : after_command;
+      if (in.kind == instruction::snippet)
+        set_id(t.strings[in.name]);
+      switch (render_file_())
+      {
+      case rendered:
+        return no_detour;
+      case left_file:
+        return plain;
+      default:
+        return after_command;
+      }
+
+    case instruction::if_:
+      if (defines_any_(t, in.lookups))
+        return start_detour_(in, rs);
+      if (render_if_(t, t.ifs[in.if_index], rs) != rendered)
+        return after_command;
+      break;
+
+    case instruction::dynamic:
+      return start_detour_(in, rs);
+    }
+
+    move_to_(rs.origin + in.end, in.end_line);
+    return no_detour;
+  }
+
+//-----------------------------------  render_if_  -------------------------------------//
+
+  render_result render_if_(const compiled_template& t, const if_statement& s,
+    const resync_point& rs)
+  {
+    bool true_done = false;
+    for (std::vector<if_statement::branch>::const_iterator it = s.branches.begin();
+      it != s.branches.end(); ++it)
+    {
+      if (true_done || (it->condition != npos && !evaluate(t, it->condition)))
+        continue;
+      true_done = true;
+      if (render_block_(t, it->body, rs) != rendered)
+      {
+        if_tail_(true, true, s.line);
+        return misaligned;
+      }
+    }
+    return rendered;
+  }
+
+//------------------------------------  detour_  ---------------------------------------//
+
+  loop_result detour_(detour_kind kind, const resync_point& rs)
+  {
+    switch (kind)
+    {
+    case landing:
+      if (is_macro_start())
+        macro_call_();
+      break;
+    case landing_ws:  // within the skip_whitespace() of a command-end
+      if (is_macro_start())
+      {
+        macro_call_();
+        skip_whitespace();
+      }
+      break;
+    case after_command:  // as text_() after command_()
+      if (state.top().cur == state.top().end)
+        return loop_end;
+      if (is_command_end())
+        advance(state.top().markers->command_end.size(), false);
+      else
+        skip_whitespace();
+      break;
+    default:
+      break;
+    }
+
+    resync = &rs;
+    loop_result result = text_loop_(true);
+    resync = 0;
+    return result;
+  }
+
+  detour_kind start_detour_(const instruction& in, const resync_point& rs)
+  {
+    move_to_(rs.origin + in.begin, in.line);
+    return !in.landed ? plain : in.ws_skip ? landing_ws : landing;
+  }
+
+//--------------------------------------  helpers  -------------------------------------//
+
+  bool find_safe_point_()  // sets resync_index if found
+  {
+    typedef std::vector<std::pair<std::size_t, std::size_t> > points_type;
+    const points_type& points(resync->code->safe_points);
+    std::size_t offset = state.top().cur - resync->origin;
+    points_type::const_iterator it(std::lower_bound(points.begin(), points.end(),
+      std::make_pair(offset, std::size_t(0))));
+    if (it == points.end() || it->first != offset)
+      return false;
+    resync_index = it->second;
+    return true;
+  }
+
+  void move_to_(const char* p, int line_number)
+  {
+    state.top().cur = state.top().line_pos = p;
+    state.top().line_number = line_number;
+  }
+
+//----------------------------------  expansion_  --------------------------------------//
+
+  const expansion& expansion_(const string& name)
+  {
+    const marker_set* markers = state.top().markers;
+    expansion& x(expansions[name]);
+    if (!x.reads.empty() && x.markers == markers)
+    {
+      if (x.generation == macro.generation())
+      {
+        if (prof && x.ok)
+          ++prof->expansions_reused;
+        return x;
+      }
+      bool valid = true;
+      for (std::size_t i = 0; valid && i < x.reads.size(); ++i)
+      {
+        const macro_table::value_ptr* value = macro.find(x.reads[i].first);
+        valid = (value ? value->get() : 0) == x.reads[i].second.get();
+      }
+      if (valid)
+      {
+        if (prof && x.ok)
+          ++prof->expansions_reused;
+        x.generation = macro.generation();
+        return x;
+      }
+    }
+
+    x.text = boost::make_shared<string>();
+    x.pushes.clear();
+    x.reads.clear();
+    x.markers = markers;
+    x.generation = macro.generation();
+    x.ok = expand_(name, x, 0);
+    if (prof && x.ok)
+      ++prof->expansions_made;
+    return x;
+  }
+
+  //  Appends the expansion of a call of name to x, recording the macros read; false if
+  //  the expansion is not just text and macro calls.
+  bool expand_(const string& name, expansion& x, int depth)
+  {
+    const macro_table::value_ptr* value = macro.find(name);
+    x.reads.push_back(std::make_pair(name, value ? *value : macro_table::value_ptr()));
+    if (!value || (*value)->empty() || depth > max_expansion_depth)
+      return false;
+
+    const string& v(**value);
+    const marker_set& m(*x.markers);
+    if (verbose)
+      x.pushes += "pushing " + m.macro_start_ + name + m.macro_end_ + " with content \""
+        + v + "\"\n";
+    if (is_plain_(v, false))
+    {
+      *x.text += v;
+      return true;
+    }
+
+    compiled_template t;
+    compile_template(v.data(), v.data(), v.data() + v.size(), m, t);
+    const block& b(t.blocks[0]);
+    if (b.terminator != v.size())  // a stray elif, else, or endif
+      return false;
+    for (std::vector<instruction>::const_iterator it = b.code.begin();
+      it != b.code.end(); ++it)
+    {
+      if (it->kind == instruction::text)
+        x.text->append(v, it->begin, it->end - it->begin);
+      else if (it->kind != instruction::macro || it->ws_skip
+        || !expand_(t.strings[it->name], x, depth + 1))
+        return false;
+    }
+    return true;
+  }
+
+  //  A macro value that renders as itself
+  bool is_plain_(const string& value, bool ws_skip)
+  {
+    return !value.empty()
+      && !(ws_skip && std::isspace(static_cast<unsigned char>(value[0])))
+      && value.find(state.top().markers->command_start) == string::npos
+      && value.find(state.top().markers->macro_start_) == string::npos;
+  }
+
+  //  The value of the environment variable name, or 0 if it isn't set
+  const char* getenv_(const char* name) const
+  {
+    if (!environment)
+      return std::getenv(name);
+    macro_map::const_iterator it(environment->find(name));
+    return it == environment->end() ? 0 : it->second.c_str();
+  }
+
+  //  True if any name of the list at t.lookups[list] is defined
+  bool defines_any_(const compiled_template& t, boost::uint32_t list)
+  {
+    for (boost::uint32_t i = list + 1, end = i + t.lookups[list]; i != end; ++i)
+      if (macro.find(t.strings[t.lookups[i]]))
+        return true;
+    return false;
+  }
+
+};  // class processor::impl
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                     processor                                        //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+processor::options::options()
+  : verbose(false), log_input(false), log_output(false), log(&std::cout),
+    compile(true), stream(false), stats(false) {}
+
+processor::processor(const options& opts)
+  : m_files(opts.files ? opts.files : boost::make_shared<file_cache>()),
+    m_impl(new impl(opts, *m_files->m_impl))
+{}
+
+processor::~processor() {}
+
+void processor::define(const string& name, const string& value)
+{
+  m_impl->macro.define(name, value);
+}
+
+void processor::define(const macro_map& definitions)
+{
+  m_impl->macro.reserve(m_impl->macro.size() + definitions.size());
+  for (macro_map::const_iterator it = definitions.cbegin();
+    it != definitions.cend(); ++it)
+  {
+    m_impl->macro.define(it->first, it->second);
+  }
+}
+
+macro_map processor::macros() const
+{
+  macro_map snapshot;
+  const std::vector<macro_table::entry>& entries(m_impl->macro.entries());
+  for (std::vector<macro_table::entry>::const_iterator it = entries.begin();
+    it != entries.end(); ++it)
+  {
+    snapshot.insert(snapshot.end(), macro_map::value_type(it->name, *it->value));
+  }
+  return snapshot;
+}
+
+const dependencies& processor::deps() const
+{
+  return m_impl->deps;
+}
+
+int processor::process(const string& in_path, std::ostream& out)
+{
+  impl& x(*m_impl);
+  int prior_errors = x.error_count;
+
+  x.in_path = in_path;
+  counting_buf counter(out.rdbuf());
+  std::ostream counted(&counter);
+  x.out = &out;
+  if (x.prof)
+  {
+    x.begin_profile_();
+    x.out = &counted;
+  }
+
+  if (x.new_context(in_path))
+  {
+    if (x.streaming)
+      x.start_streaming_();
+    if (x.compiled && x.reused_input_())
+      x.render_file_();
+    else
+      x.text_();
+
+    if (x.verbose)
+    {
+      *x.log << "Dump macro definitions:\n";
+      const macro_map sorted(macros());
+      for (macro_map::const_iterator it = sorted.cbegin(); it != sorted.cend(); ++it)
+      {
+        *x.log << "  " << it->first << ": \"" << it->second << "\"\n";
+      }
+    }
+  }
+
+  while (!x.state.empty())
+    x.pop_();
+  x.stream_src.reset();
+  x.scratch.reset();
+  x.out = 0;
+  x.save_cache_();
+
+  if (x.prof)
+  {
+    if (counted.bad())
+      out.setstate(std::ios_base::badbit);
+    x.end_profile_(counter.count());
+  }
+  return x.error_count - prior_errors;
+}
+
+}  // namespace mmp
@@ -0,0 +1,322 @@
+//  server.cpp  ------------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdlib>
+#include <boost/make_shared.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/asio.hpp>
+
+using std::string;
+namespace fs = boost::filesystem;
+
+//  A request is a sequence of fields, each ended by a '\0', and ended by an empty field:
+//  the client's current directory, the input path, the output path, then any number
+//  of "-verbose", "-interpret", "name=value", and profile fields, then "-environment"
+//  followed by a "name=value" field for each of the client's environment variables.
+//  A marker profile is a "-profile" field followed by the extension, command-start,
+//  command-end, macro-start, and macro-end, each preceded by a '>' so that none is
+//  empty. The response is the error count, a '\n', the dependencies, and the
+//  diagnostics, after which the server closes the connection. The dependencies are a
+//  field for each file read, its path preceded by 'f', and for each environment
+//  variable read, its name preceded by 'e', ended by an empty field.
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+#ifdef _WIN32
+# define environ _environ
+#else
+extern char** environ;
+#endif
+
+namespace
+{
+  namespace asio = boost::asio;
+  typedef asio::local::stream_protocol protocol;
+
+  const string end_of_request("\0\0", 2);
+
+//-----------------------------------  request_  ---------------------------------------//
+
+  struct request_
+  {
+    string                cwd;
+    string                in_path;
+    string                out_path;
+    bool                  verbose;
+    bool                  interpret;
+    mmp::macro_map        definitions;
+    mmp::marker_profile_map
+                          profiles;
+    boost::shared_ptr<mmp::macro_map>
+                          environment;  // the client's
+
+    bool parse(const string& msg)  // true if succeeds
+    {
+      std::vector<string> fields;
+      for (string::size_type pos = 0, end;
+        (end = msg.find('\0', pos)) != string::npos && end != pos; pos = end + 1)
+      {
+        fields.push_back(msg.substr(pos, end - pos));
+      }
+      if (fields.size() < 3)
+        return false;
+
+      cwd = fields[0];
+      in_path = fields[1];
+      out_path = fields[2];
+      verbose = interpret = false;
+      environment = boost::make_shared<mmp::macro_map>();
+      mmp::macro_map* target = &definitions;
+      for (std::size_t i = 3; i < fields.size(); ++i)
+      {
+        string::size_type eq = fields[i].find('=');
+        if (fields[i] == "-verbose" && target == &definitions)
+          verbose = true;
+        else if (fields[i] == "-interpret" && target == &definitions)
+          interpret = true;
+        else if (fields[i] == "-environment" && target == &definitions)
+          target = environment.get();
+        else if (fields[i] == "-profile" && target == &definitions)
+        {
+          string profile[5];
+          for (int j = 0; j < 5; ++j)
+          {
+            if (++i == fields.size() || fields[i][0] != '>')
+              return false;
+            profile[j] = fields[i].substr(1);
+          }
+          mmp::marker_profile& m(profiles[profile[0]]);
+          m.command_start = profile[1];
+          m.command_end = profile[2];
+          m.macro_start = profile[3];
+          m.macro_end = profile[4];
+        }
+        else if (eq != string::npos && eq != 0)
+          (*target)[fields[i].substr(0, eq)] = fields[i].substr(eq + 1);
+        else
+          return false;
+      }
+      return target != &definitions;
+    }
+  };
+
+//----------------------------------  serve_one  ---------------------------------------//
+
+  //  The files loaded by requests from one directory are kept in one file_cache, as
+  //  the cache is keyed by the paths as given, which are relative to that directory.
+
+  typedef std::map<string, boost::shared_ptr<mmp::file_cache> > cache_map;
+
+  string serve_one(const string& msg, const mmp::macro_map& definitions,
+    const mmp::processor::options& opts, cache_map& caches)
+  {
+    request_ rq;
+    if (!rq.parse(msg))
+      return "1\nerror: malformed request\n";
+
+    boost::system::error_code ec;
+    fs::current_path(rq.cwd, ec);
+    if (ec)
+      return "1\nerror: could not change to directory " + rq.cwd + '\n';
+
+    boost::shared_ptr<mmp::file_cache>& files(caches[rq.cwd]);
+    if (!files)
+      files = boost::make_shared<mmp::file_cache>();
+    else
+      files->forget_changed();
+
+    std::ostringstream log;
+    int error_count = 0;
+
+    mmp::output_file out(rq.out_path);
+    mmp::processor::options o(opts);
+    o.log = &log;
+    o.files = files;
+    o.verbose = rq.verbose;
+    o.compile = opts.compile && !rq.interpret;
+    o.environment = rq.environment;
+    for (mmp::marker_profile_map::const_iterator it = rq.profiles.begin();
+      it != rq.profiles.end(); ++it)
+      o.profiles[it->first] = it->second;
+    mmp::processor processor(o);
+    processor.define(definitions);
+    processor.define(rq.definitions);
+    error_count = processor.process(rq.in_path, out.stream());
+    if (!out.commit())
+    {
+      log << rq.in_path << ": error: could not write output file " << rq.out_path << '\n';
+      ++error_count;
+    }
+
+    std::ostringstream response;
+    response << error_count << '\n';
+    const mmp::dependencies& deps(processor.deps());
+    for (std::set<string>::const_iterator it = deps.files.begin();
+      it != deps.files.end(); ++it)
+      response << 'f' << *it << '\0';
+    for (std::set<string>::const_iterator it = deps.environment.begin();
+      it != deps.environment.end(); ++it)
+      response << 'e' << *it << '\0';
+    response << '\0' << log.str();
+    return response.str();
+  }
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//-------------------------------------  serve  ----------------------------------------//
+
+  int serve(const string& socket_path, const macro_map& definitions,
+    const processor::options& opts)
+  {
+    try
+    {
+      asio::io_context io;
+      boost::system::error_code ec;
+      fs::remove(socket_path, ec);  // left behind by an earlier server
+      protocol::acceptor acceptor(io, protocol::endpoint(socket_path));
+      if (opts.verbose)
+        *opts.log << "serving at " << socket_path << std::endl;
+
+      cache_map caches;
+      for (;;)
+      {
+        protocol::socket socket(io);
+        acceptor.accept(socket);
+        try
+        {
+          asio::streambuf buf;
+          std::size_t n = asio::read_until(socket, buf, end_of_request);
+          string msg(asio::buffers_begin(buf.data()),
+            asio::buffers_begin(buf.data()) + n);
+          asio::write(socket, asio::buffer(serve_one(msg, definitions, opts, caches)));
+        }
+        catch (const boost::system::system_error& ex)  // the client went away
+        {
+          if (opts.verbose)
+            *opts.log << "request failed: " << ex.what() << std::endl;
+        }
+      }
+    }
+    catch (const boost::system::system_error& ex)
+    {
+      *opts.log << "error: could not serve at " << socket_path << ": " << ex.what()
+                << std::endl;
+      return 1;
+    }
+  }
+
+//------------------------------------  request  ---------------------------------------//
+
+  int request(const string& socket_path, const string& in_path,
+    const string& out_path, const macro_map& definitions,
+    const processor::options& opts, dependencies* deps)
+  {
+    string msg(fs::current_path().string());
+    msg += '\0';
+    msg += in_path + '\0';
+    msg += out_path + '\0';
+    if (opts.verbose)
+      msg += string("-verbose") + '\0';
+    if (!opts.compile)
+      msg += string("-interpret") + '\0';
+    for (macro_map::const_iterator it = definitions.cbegin();
+      it != definitions.cend(); ++it)
+    {
+      msg += it->first + '=' + it->second + '\0';
+    }
+    for (marker_profile_map::const_iterator it = opts.profiles.begin();
+      it != opts.profiles.end(); ++it)
+    {
+      msg += string("-profile") + '\0' + '>' + it->first + '\0'
+        + '>' + it->second.command_start + '\0' + '>' + it->second.command_end + '\0'
+        + '>' + it->second.macro_start + '\0' + '>' + it->second.macro_end + '\0';
+    }
+    msg += string("-environment") + '\0';
+    for (char** var = environ; *var; ++var)
+      if (**var && **var != '=')  // Windows has hidden "=C:=C:\\dir" entries
+        msg += string(*var) + '\0';
+    msg += '\0';
+
+    string response;
+    try
+    {
+      asio::io_context io;
+      protocol::socket socket(io);
+      socket.connect(protocol::endpoint(socket_path));
+      asio::write(socket, asio::buffer(msg));
+
+      boost::system::error_code ec;
+      asio::streambuf buf;
+      asio::read(socket, buf, ec);
+      if (ec && ec != asio::error::eof)
+        throw boost::system::system_error(ec);
+      response.assign(asio::buffers_begin(buf.data()), asio::buffers_end(buf.data()));
+    }
+    catch (const boost::system::system_error&)
+    {
+      return -1;
+    }
+
+    string::size_type pos = response.find('\n');
+    if (pos == string::npos)
+      return -1;
+    dependencies received;
+    for (string::size_type begin = pos + 1; ; begin = pos + 1)
+    {
+      if ((pos = response.find('\0', begin)) == string::npos)
+        return -1;
+      if (pos == begin)  // the empty field ending the dependencies
+        break;
+      string field(response, begin + 1, pos - begin - 1);
+      if (response[begin] == 'f')
+        received.files.insert(field);
+      else if (response[begin] == 'e')
+        received.environment.insert(field);
+      else
+        return -1;
+    }
+    if (deps)
+      *deps = received;
+    *opts.log << response.substr(pos + 1) << std::flush;
+    return std::atoi(response.c_str());
+  }
+
+}  // namespace mmp
+
+#else  // no local sockets
+
+namespace mmp
+{
+  int serve(const string& socket_path, const macro_map&,
+    const processor::options& opts)
+  {
+    *opts.log << "error: could not serve at " << socket_path
+              << ": local sockets are not supported on this platform\n";
+    return 1;
+  }
+
+  int request(const string&, const string&, const string&, const macro_map&,
+    const processor::options&, dependencies*)
+  {
+    return -1;
+  }
+
+}  // namespace mmp
+
+#endif
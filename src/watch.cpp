@@ -0,0 +1,243 @@
+//  watch.cpp  -------------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "mmp.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <boost/make_shared.hpp>
+#include <boost/filesystem.hpp>
+#if defined(__linux__)
+# include <sys/inotify.h>
+# include <poll.h>
+# include <unistd.h>
+#else
+# include <boost/thread/thread.hpp>
+#endif
+
+using std::string;
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+//-----------------------------------  watcher  ----------------------------------------//
+
+  //  Reports changes to a set of files, each known by the path it was added as.
+
+#if defined(__linux__)
+
+  //  Directories, rather than files, are watched, so files replaced by renaming over
+  //  them, as many editors save, are still seen. A directory may be reached by several
+  //  paths, so it is identified by its canonical path.
+
+  class watcher
+  {
+  public:
+    watcher() : m_fd(inotify_init1(IN_CLOEXEC)) {}
+    ~watcher() { if (m_fd >= 0) ::close(m_fd); }
+
+    bool ok() const { return m_fd >= 0; }
+
+    void add(const string& path)
+    {
+      fs::path p(path);
+      boost::system::error_code ec;
+      fs::path dir(fs::canonical(fs::absolute(p).parent_path(), ec));
+      if (ec)
+        return;
+
+      std::map<string, int>::const_iterator it(m_wds.find(dir.string()));
+      int wd;
+      if (it != m_wds.end())
+        wd = it->second;
+      else
+      {
+        wd = inotify_add_watch(m_fd, dir.c_str(),
+          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+        if (wd < 0)
+          return;
+        m_wds[dir.string()] = wd;
+      }
+      m_paths[std::make_pair(wd, p.filename().string())].insert(path);
+    }
+
+    //  Blocks until a watched file changes, then collects the changes that follow
+    //  within a moment, so saving several files is seen as one change.
+    void wait(std::set<string>& changed)
+    {
+      while (changed.empty())
+        read(-1, changed);
+      while (read(50, changed))
+        {}
+    }
+
+  private:
+    typedef std::map<std::pair<int, string>, std::set<string> > path_map;
+
+    int                    m_fd;
+    std::map<string, int>  m_wds;    // canonical directory to watch descriptor
+    path_map               m_paths;  // directory and file name to the paths added
+
+    bool read(int timeout, std::set<string>& changed)  // true if there were events
+    {
+      pollfd pfd = { m_fd, POLLIN, 0 };
+      if (::poll(&pfd, 1, timeout) <= 0)
+        return false;
+
+      alignas(inotify_event) char buf[4096];
+      ssize_t n = ::read(m_fd, buf, sizeof(buf));
+      for (const char* p = buf; n > 0 && p < buf + n;)
+      {
+        const inotify_event* ev = reinterpret_cast<const inotify_event*>(p);
+        if (ev->mask & IN_Q_OVERFLOW)  // events were lost, so any file may have changed
+        {
+          for (path_map::const_iterator it = m_paths.begin(); it != m_paths.end(); ++it)
+            changed.insert(it->second.begin(), it->second.end());
+        }
+        else if (ev->len)
+        {
+          path_map::const_iterator it(m_paths.find(std::make_pair(ev->wd,
+            string(ev->name))));
+          if (it != m_paths.end())
+            changed.insert(it->second.begin(), it->second.end());
+        }
+        p += sizeof(inotify_event) + ev->len;
+      }
+      return true;
+    }
+  };
+
+#else
+
+  //  Polls the last write time of each file.
+
+  class watcher
+  {
+  public:
+    bool ok() const { return true; }
+
+    void add(const string& path)
+    {
+      if (!m_times.count(path))
+        m_times[path] = time(path);
+    }
+
+    void wait(std::set<string>& changed)
+    {
+      while (changed.empty())
+      {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(250));
+        for (std::map<string, std::time_t>::iterator it = m_times.begin();
+          it != m_times.end(); ++it)
+        {
+          std::time_t t = time(it->first);
+          if (t != it->second)
+          {
+            it->second = t;
+            changed.insert(it->first);
+          }
+        }
+      }
+    }
+
+  private:
+    std::map<string, std::time_t>  m_times;
+
+    static std::time_t time(const string& path)  // -1 if missing
+    {
+      boost::system::error_code ec;
+      std::time_t t = fs::last_write_time(path, ec);
+      return ec ? -1 : t;
+    }
+  };
+
+#endif
+
+  bool intersects(const std::set<string>& x, const std::set<string>& y)
+  {
+    for (std::set<string>::const_iterator it = x.begin(); it != x.end(); ++it)
+      if (y.count(*it))
+        return true;
+    return false;
+  }
+
+}  // unnamed namespace
+
+namespace mmp
+{
+
+//-------------------------------------  watch  ----------------------------------------//
+
+  int watch(const std::vector<batch_item>& items, const macro_map& definitions,
+    const processor::options& opts, unsigned threads, watch_callback rendered)
+  {
+    processor::options o(opts);
+    if (!o.files)
+      o.files = boost::make_shared<file_cache>();  // kept from round to round
+
+    std::vector<dependencies> deps;
+    int error_count = process_batch(items, definitions, o, threads, &deps);
+    if (rendered)
+      rendered(items, deps, error_count);
+
+    watcher w;
+    if (!w.ok())
+    {
+      *o.log << "error: could not watch the input files for changes\n";
+      return error_count + 1;
+    }
+    for (std::size_t i = 0; i < deps.size(); ++i)
+      for (std::set<string>::const_iterator it = deps[i].files.begin();
+        it != deps[i].files.end(); ++it)
+      {
+        w.add(*it);
+      }
+
+    for (;;)
+    {
+      std::set<string> changed;
+      w.wait(changed);
+      for (std::set<string>::const_iterator it = changed.begin();
+        it != changed.end(); ++it)
+      {
+        o.files->forget(*it);
+      }
+
+      std::vector<batch_item> affected;
+      std::vector<std::size_t> index;  // of each affected item in items
+      for (std::size_t i = 0; i < items.size(); ++i)
+        if (intersects(deps[i].files, changed))
+        {
+          affected.push_back(items[i]);
+          index.push_back(i);
+        }
+      if (affected.empty())
+        continue;
+
+      std::vector<dependencies> affected_deps;
+      error_count = process_batch(affected, definitions, o, threads, &affected_deps);
+      for (std::size_t i = 0; i < index.size(); ++i)
+      {
+        deps[index[i]] = affected_deps[i];
+        for (std::set<string>::const_iterator it = deps[index[i]].files.begin();
+          it != deps[index[i]].files.end(); ++it)
+        {
+          w.add(*it);
+        }
+      }
+      if (rendered)
+        rendered(items, deps, error_count);
+    }
+  }
+
+}  // namespace mmp
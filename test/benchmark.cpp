@@ -0,0 +1,413 @@
+//  benchmark.cpp  ---------------------------------------------------------------------//
+
+//   Copyright Beman Dawes, 2011
+
+//  Licensed under the Boost Software License, Version 1.0.
+//  See http://www.boost.org/LICENSE_1_0.txt
+
+//  Generates a synthetic corpus for each of several shapes of input, processes it, and
+//  reports the throughput and peak memory, one line per shape, so that the results of
+//  two builds can be compared. Each shape is run in a process of its own, so that its
+//  peak memory is its own.
+//
+//  Usage: benchmark [-size=megabytes] [-runs=n] [-interpret] [-stream] [-reuse]
+//                   [shape...]
+//
+//  With -reuse, the runs share one file cache, as the items of a batch or the requests
+//  to a server do, so the runs after the first render the input's compiled template.
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../src/mmp.hpp"
+#include <boost/detail/lightweight_main.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#ifdef _WIN32
+# include <windows.h>
+# include <psapi.h>
+# pragma comment(lib, "psapi.lib")
+#else
+# include <sys/resource.h>
+#endif
+
+using std::cout;
+using std::string;
+namespace fs = boost::filesystem;
+
+//--------------------------------------------------------------------------------------//
+
+namespace
+{
+  boost::uintmax_t  size = 16 * 1024 * 1024;  // of the input of each shape, roughly
+  int               runs = 3;                  // the fastest is reported
+  bool              interpret = false;
+  bool              stream = false;
+  bool              reuse = false;
+
+  const char* const lorem =
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor ";
+
+  struct corpus
+  {
+    boost::uintmax_t  bytes;       // of input processed, counting every use of a file
+    boost::uintmax_t  expansions;  // of macros
+  };
+
+  //  Each generator writes main.txt, and any files it uses, to the current directory.
+  typedef corpus (*generator)();
+
+//-------------------------------------  plain  ----------------------------------------//
+
+  //  Text with a macro call every 64 lines, so nearly all of it is scanned for markers
+  //  and copied.
+
+  corpus plain()
+  {
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    os << "$def TITLE \"Benchmark\"\n";
+    for (unsigned long line = 0; os.tellp() < static_cast<std::streamoff>(size); ++line)
+    {
+      os << lorem;
+      if (line % 64 == 0)
+      {
+        os << "$TITLE;";
+        ++c.expansions;
+      }
+      os << '\n';
+    }
+    c.bytes = os.tellp();
+    return c;
+  }
+
+//-------------------------------------  dense  ----------------------------------------//
+
+  //  Lines of short words, each followed by a call of one of 16 macros.
+
+  corpus dense()
+  {
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    for (int i = 0; i < 16; ++i)
+      os << "$def M" << i << " \"value " << i << "\"\n";
+    for (unsigned long n = 0; os.tellp() < static_cast<std::streamoff>(size); ++n)
+    {
+      os << "word $M" << n % 16 << "; ";
+      ++c.expansions;
+      if (n % 8 == 7)
+        os << '\n';
+    }
+    c.bytes = os.tellp();
+    return c;
+  }
+
+//------------------------------------  nested  ----------------------------------------//
+
+  //  Calls of a macro whose value calls another, and so on 24 deep. The null macro
+  //  defers each call in a definition until the value is expanded.
+
+  corpus nested()
+  {
+    const int depth = 24;
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    os << "$def N0 \"leaf\"\n";
+    for (int i = 1; i <= depth; ++i)
+      os << "$def N" << i << " \"($;N" << i - 1 << ";)\"\n";
+    while (os.tellp() < static_cast<std::streamoff>(size))
+    {
+      os << "The value is $N" << depth << "; today.\n";
+      c.expansions += depth + 1;
+    }
+    c.bytes = os.tellp();
+    return c;
+  }
+
+//------------------------------------  if_chain  --------------------------------------//
+
+  //  Chains of 100 branches, each chain taking a different one.
+
+  corpus if_chain()
+  {
+    const int branches = 100;
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    for (unsigned long n = 0; os.tellp() < static_cast<std::streamoff>(size); ++n)
+    {
+      os << "$def X v" << n % branches << "\n$if $X; == v0\n  branch 0\n";
+      for (int i = 1; i < branches; ++i)
+        os << "$elif $X; == v" << i << "\n  branch " << i << '\n';
+      os << "$endif\n";
+      c.expansions += n % branches + 1;
+    }
+    c.bytes = os.tellp();
+    return c;
+  }
+
+//------------------------------------  snippets  --------------------------------------//
+
+  //  Snippets taken in turn from a source file of 1000 snippets of about 1 KB each.
+
+  corpus snippets()
+  {
+    const int count = 1000;
+    std::vector<boost::uintmax_t> sizes;
+    {
+      std::ofstream os("source.txt", std::ios_base::out|std::ios_base::binary);
+      for (int i = 0; i < count; ++i)
+      {
+        os << "$id s" << i << '=';
+        std::streamoff start = os.tellp();
+        for (int line = 0; line < 12; ++line)
+          os << lorem << '\n';
+        sizes.push_back(os.tellp() - start);
+        os << "$endid\n";
+      }
+    }
+
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    for (unsigned long n = 0; c.bytes < size; ++n)
+    {
+      os << "$snippet s" << n % count << " \"source.txt\"\n";
+      c.bytes += sizes[n % count];
+    }
+    c.bytes += os.tellp();
+    return c;
+  }
+
+//----------------------------------  include_tree  ------------------------------------//
+
+  //  Includes of a binary tree of files 10 deep, each with a macro call. The text of
+  //  an include goes on in the including file, so in an interpreted run each include
+  //  nests a stack frame until the input ends. The tree is therefore included a fixed
+  //  number of times, and the files grow with the size instead.
+
+  corpus include_tree()
+  {
+    const int depth = 10;
+    const int trees = 4;  // includes of the whole tree
+    const boost::uintmax_t lines = std::max<boost::uintmax_t>(1,
+      size / (trees * ((2 << depth) - 1) * std::strlen(lorem)));  // per file
+    corpus tree = { 0, 0 };
+    for (int d = 0; d <= depth; ++d)
+    {
+      for (int i = 0; i < 1 << d; ++i)
+      {
+        std::ostringstream path;
+        path << "t" << d << '_' << i << ".txt";
+        std::ofstream os(path.str().c_str(), std::ios_base::out|std::ios_base::binary);
+        os << "File " << path.str() << " of $NAME;\n";
+        for (boost::uintmax_t line = 0; line < lines; ++line)
+          os << lorem << '\n';
+        if (d < depth)
+          os << "$include \"t" << d + 1 << '_' << 2 * i << ".txt\"\n"
+             << "$include \"t" << d + 1 << '_' << 2 * i + 1 << ".txt\"\n";
+        tree.bytes += os.tellp();
+        ++tree.expansions;
+      }
+    }
+
+    std::ofstream os("main.txt", std::ios_base::out|std::ios_base::binary);
+    corpus c = { 0, 0 };
+    os << "$def NAME \"the tree\"\n";
+    for (int n = 0; n < trees; ++n)
+    {
+      os << "$include \"t0_0.txt\"\n";
+      c.bytes += tree.bytes;
+      c.expansions += tree.expansions;
+    }
+    c.bytes += os.tellp();
+    return c;
+  }
+
+//-------------------------------------  shapes  ---------------------------------------//
+
+  struct shape
+  {
+    const char*  name;
+    generator    generate;
+  };
+
+  const shape shapes[] =
+  {
+    { "plain", plain },
+    { "dense", dense },
+    { "nested", nested },
+    { "if_chain", if_chain },
+    { "snippets", snippets },
+    { "include_tree", include_tree },
+  };
+
+  const shape* find_shape(const char* name)  // 0 if not found
+  {
+    for (std::size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i)
+      if (std::strcmp(shapes[i].name, name) == 0)
+        return &shapes[i];
+    return 0;
+  }
+
+//-------------------------------------  helpers  --------------------------------------//
+
+  class null_buf : public std::streambuf  // discards its output
+  {
+  protected:
+    std::streamsize xsputn(const char*, std::streamsize n) { return n; }
+    int_type overflow(int_type c) { return traits_type::not_eof(c); }
+  };
+
+  double peak_rss()  // megabytes
+  {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    ::GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+# ifdef __APPLE__
+    return usage.ru_maxrss / 1048576.0;  // bytes
+# else
+    return usage.ru_maxrss / 1024.0;     // kilobytes
+# endif
+#endif
+  }
+
+//--------------------------------------  run  -----------------------------------------//
+
+  //  Generates and processes the corpus for s in a new temporary directory, and reports
+  //  the fastest of the runs. Returns the number of errors detected.
+
+  int run(const shape& s)
+  {
+    fs::path initial(fs::current_path());
+    fs::path dir(fs::temp_directory_path() / fs::unique_path("mmp-benchmark-%%%%-%%%%"));
+    fs::create_directories(dir);
+    fs::current_path(dir);
+
+    corpus c = s.generate();
+
+    mmp::processor::options opts;
+    std::ostringstream log;
+    opts.log = &log;
+    opts.compile = !interpret;
+    opts.stream = stream;
+    if (reuse)
+      opts.files = boost::make_shared<mmp::file_cache>();
+
+    double best = 0.0;
+    int error_count = 0;
+    for (int i = 0; i < runs; ++i)
+    {
+      null_buf discard;
+      std::ostream out(&discard);
+      mmp::processor processor(opts);  // and, unless reuse, a file cache of its own,
+                                       // so every run is as a separate run of mmp
+      std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+      error_count = processor.process("main.txt", out);
+      double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      if (i == 0 || seconds < best)
+        best = seconds;
+    }
+
+    fs::current_path(initial);
+    fs::remove_all(dir);
+
+    double megabytes = c.bytes / 1048576.0;
+    cout << std::left << std::setw(14) << s.name << std::right << std::fixed
+         << std::setprecision(1) << std::setw(9) << megabytes
+         << std::setprecision(3) << std::setw(10) << best
+         << std::setprecision(1) << std::setw(10) << megabytes / best
+         << std::setprecision(0) << std::setw(15) << c.expansions / best
+         << std::setprecision(1) << std::setw(10) << peak_rss() << std::endl;
+    if (error_count)
+      cout << "  " << error_count << " error(s) detected:\n" << log.str();
+    return error_count;
+  }
+
+}  // unnamed namespace
+
+//--------------------------------------------------------------------------------------//
+//                                                                                      //
+//                                     cpp_main                                         //
+//                                                                                      //
+//--------------------------------------------------------------------------------------//
+
+int cpp_main(int argc, char* argv[])
+{
+  string options;  // passed on to each shape's process
+  const char* only = 0;  // the shape to run in this process, if any
+  std::vector<const shape*> selected;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strncmp(argv[i], "-size=", 6) == 0)
+      size = static_cast<boost::uintmax_t>(std::atof(argv[i] + 6) * 1024 * 1024);
+    else if (std::strncmp(argv[i], "-runs=", 6) == 0)
+      runs = std::atoi(argv[i] + 6) > 0 ? std::atoi(argv[i] + 6) : 1;
+    else if (std::strcmp(argv[i], "-interpret") == 0)
+      interpret = true;
+    else if (std::strcmp(argv[i], "-stream") == 0)
+      stream = true;
+    else if (std::strcmp(argv[i], "-reuse") == 0)
+      reuse = true;
+    else if (std::strncmp(argv[i], "-shape=", 7) == 0)
+    {
+      only = argv[i] + 7;
+      continue;
+    }
+    else if (const shape* s = find_shape(argv[i]))
+    {
+      selected.push_back(s);
+      continue;
+    }
+    else
+    {
+      cout << "Error: unknown shape or option: " << argv[i] << "\n"
+        "Usage: benchmark [-size=megabytes] [-runs=n] [-interpret] [-stream] [-reuse]\n"
+        "                 [shape...]\n"
+        "  shape: plain, dense, nested, if_chain, snippets, or include_tree; default\n"
+        "         is all of them\n";
+      return 1;
+    }
+    options += ' ';
+    options += argv[i];
+  }
+
+  if (only)
+  {
+    const shape* s = find_shape(only);
+    return s ? (run(*s) ? 1 : 0) : 1;
+  }
+
+  if (selected.empty())
+    for (std::size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i)
+      selected.push_back(&shapes[i]);
+
+  cout << "shape          input MB   seconds      MB/s   expansions/s   peak MB\n";
+  int failures = 0;
+  for (std::vector<const shape*>::const_iterator it = selected.begin();
+    it != selected.end(); ++it)
+  {
+    string command("\"" + string(argv[0]) + "\" -shape=" + (*it)->name + options);
+#ifdef _WIN32
+    command = "\"" + command + "\"";  // cmd.exe strips the outer quotes
+#endif
+    cout.flush();
+    if (std::system(command.c_str()) != 0)
+      ++failures;
+  }
+  return failures ? 1 : 0;
+}